@@ -11,6 +11,7 @@
 
 
 #include <assert.h>
+#include <algorithm>
 #include "actions.h"
 #include "search.h"
 
@@ -39,7 +40,10 @@ void actions::analyze()
     
     // Traverse automata using actions and check if any rules are unreachable.
     _automata->visited += 1;
-    traverse_rules( _automata->start );
+    for ( state* start : _automata->starts )
+    {
+        traverse_rules( start );
+    }
     
     // Report any unreachable rules and assign rule indices.
     int index = 0;
@@ -121,7 +125,7 @@ action_table_ptr actions::build_action_table()
                 break;
             
             case ACTION_SHIFT:
-                if ( action.shift->next != _automata->accept )
+                if ( ! accepts( action.shift->next ) )
                 {
                     assert( action.shift->next->index != -1 );
                     actval = action.shift->next->index;
@@ -165,8 +169,253 @@ action_table_ptr actions::build_action_table()
         }
     }
 
+    // A token with no action of its own is retried with its fallback token.
+    // Where the fallback shifts, fold the shift into the table so that the
+    // parser does not need to retry.  Reductions and conflicts are left to
+    // the parser, to keep the rows which reduce on the fallback token small.
+    table->fallbacks.resize( table->token_count );
+    for ( const auto& entry : _automata->syntax->terminals )
+    {
+        terminal* term = entry.second.get();
+        table->fallbacks[ term->value ] = term->fallback ? term->fallback->value : term->value;
+    }
+
+    for ( int state = 0; state < table->state_count; ++state )
+    {
+        for ( int token = 0; token < table->token_count; ++token )
+        {
+            int action = fallback_action( table.get(), state, token );
+            if ( action < table->state_count )
+            {
+                table->actions[ state * table->token_count + token ] = action;
+            }
+        }
+    }
+
     // Compress table.
     table->compressed = compress( table->token_count, table->state_count, table->error_action, table->actions );
+
+    // List the states which shift each token, so that a parse can be started
+    // from an unknown state just before the token.
+    for ( int token = 0; token < table->token_count; ++token )
+    {
+        table->token_state_index.push_back( (int)table->token_states.size() );
+        for ( int state = 0; state < table->state_count; ++state )
+        {
+            int action = table->actions.at( state * table->token_count + token );
+            if ( action < table->state_count )
+            {
+                table->token_states.push_back( state );
+            }
+        }
+    }
+    table->token_state_index.push_back( (int)table->token_states.size() );
+
+    // Build a bitset for each state of the tokens which do not cause an
+    // error, so that the parser can report the tokens it expects.
+    table->token_words = ( table->token_count + 15 ) / 16;
+    table->expected_tokens.assign( table->state_count * table->token_words, 0 );
+    for ( int state = 0; state < table->state_count; ++state )
+    {
+        for ( int token = 0; token < table->token_count; ++token )
+        {
+            int action = fallback_action( table.get(), state, token );
+            if ( action != table->error_action )
+            {
+                int word = state * table->token_words + token / 16;
+                table->expected_tokens[ word ] |= 1 << ( token % 16 );
+            }
+        }
+    }
+
+    // List the predicates guarding each shift and reduce action, so that the
+    // parser can discard alternatives at a conflict.  A shift is guarded only
+    // if every location which shifts the token has a predicate.
+    std::vector< std::vector< int > > guards( table->state_count + table->rule_count );
+    std::vector< bool > unguarded( guards.size(), false );
+    for ( const auto& trans : _automata->transitions )
+    {
+        if ( ! trans->sym->is_terminal || ! trans->prev->reachable || accepts( trans->next ) )
+        {
+            continue;
+        }
+
+        int action = trans->next->index;
+        for ( size_t i = 0; i < trans->prev->closure->size; ++i )
+        {
+            const location& loc = _automata->syntax->locations.at( trans->prev->closure->locations[ i ] );
+            if ( loc.sym != trans->sym )
+            {
+                continue;
+            }
+
+            if ( loc.predicate == -1 )
+            {
+                unguarded[ action ] = true;
+            }
+            else if ( std::find( guards[ action ].begin(), guards[ action ].end(), loc.predicate ) == guards[ action ].end() )
+            {
+                guards[ action ].push_back( loc.predicate );
+            }
+        }
+    }
+
+    for ( rule* rule : table->rules )
+    {
+        if ( rule->predicate != -1 )
+        {
+            guards[ table->state_count + rule->index ].push_back( rule->predicate );
+        }
+    }
+
+    for ( size_t action = 0; action < guards.size(); ++action )
+    {
+        table->predicate_index.push_back( (int)table->predicates.size() );
+        if ( ! unguarded[ action ] )
+        {
+            table->predicates.insert( table->predicates.end(), guards[ action ].begin(), guards[ action ].end() );
+        }
+    }
+    table->predicate_index.push_back( (int)table->predicates.size() );
+
+    // Where each token which can follow a conflict is accepted by only one of
+    // its alternatives, list the action that second token selects, so that
+    // the parser can wait for it instead of splitting.  Conflicts on the end
+    // of input, or with alternatives guarded by predicates, always split.
+    std::vector< state* > states( table->state_count );
+    for ( const auto& state : _automata->states )
+    {
+        if ( state->reachable )
+        {
+            states.at( state->index ) = state.get();
+        }
+    }
+
+    for ( int state = 0; state < table->state_count; ++state )
+    {
+        table->lookahead_index.push_back( (int)table->lookaheads.size() / 3 );
+        for ( int token = 1; token < table->token_count; ++token )
+        {
+            int action = table->actions.at( state * table->token_count + token );
+            if ( action < table->state_count + table->rule_count || action >= table->accept_action )
+            {
+                continue;
+            }
+
+            const int* conflict = table->conflicts.data() + ( action - table->state_count - table->rule_count );
+            bool guarded = false;
+            std::vector< std::vector< bool > > follows;
+            for ( int i = 1; i < conflict[ 0 ]; ++i )
+            {
+                int alternative = conflict[ i ];
+                guarded = guarded || table->predicate_index.at( alternative ) != table->predicate_index.at( alternative + 1 );
+                std::vector< bool > follow( table->token_count, false );
+                std::set< std::pair< int, int > > visited;
+                follow_action( table.get(), states, state, token, alternative, &follow, &visited );
+                follows.push_back( std::move( follow ) );
+            }
+
+            if ( guarded )
+            {
+                continue;
+            }
+
+            for ( int next = 0; next < table->token_count; ++next )
+            {
+                int chosen = -1;
+                int count = 0;
+                for ( size_t i = 0; i < follows.size(); ++i )
+                {
+                    if ( follows[ i ][ next ] )
+                    {
+                        chosen = conflict[ 1 + i ];
+                        count += 1;
+                    }
+                }
+
+                if ( count == 1 )
+                {
+                    table->lookaheads.push_back( token );
+                    table->lookaheads.push_back( next );
+                    table->lookaheads.push_back( chosen );
+                }
+            }
+        }
+    }
+    table->lookahead_index.push_back( (int)table->lookaheads.size() / 3 );
+
+    // Find the states where a token can only open a lazy nonterminal.  The
+    // parser skips the region instead of shifting the token.
+    std::vector< nonterminal* > lazy_nterms;
+    for ( const auto& entry : _automata->syntax->nonterminals )
+    {
+        if ( entry.second->lspecified )
+        {
+            lazy_nterms.push_back( entry.second.get() );
+        }
+    }
+
+    std::vector< std::vector< int > > lazy_states( table->token_count );
+    for ( const auto& state : _automata->states )
+    {
+        if ( ! state->reachable )
+            continue;
+
+        for ( nonterminal* nterm : lazy_nterms )
+        {
+            int token = nterm->lopen->value;
+            int action = table->actions.at( state->index * table->token_count + token );
+            if ( action >= table->state_count )
+            {
+                continue;
+            }
+
+            // Every location which shifts the token must start the nonterminal.
+            bool lazy = true;
+            for ( size_t i = 0; i < state->closure->size; ++i )
+            {
+                size_t iloc = state->closure->locations[ i ];
+                const location& loc = _automata->syntax->locations.at( iloc );
+                if ( loc.sym == nterm->lopen && ( loc.drule->nterm != nterm || iloc != loc.drule->lostart ) )
+                {
+                    lazy = false;
+                    break;
+                }
+            }
+
+            if ( lazy )
+            {
+                std::vector< int >& states = lazy_states.at( token );
+                states.push_back( state->index );
+                states.push_back( nterm->value - table->token_count );
+                states.push_back( nterm->lclose->value );
+            }
+        }
+    }
+
+    for ( nonterminal* nterm : lazy_nterms )
+    {
+        const std::vector< int >& states = lazy_states.at( nterm->lopen->value );
+        bool skipped = false;
+        for ( size_t i = 0; i < states.size(); i += 3 )
+        {
+            skipped = skipped || states.at( i + 1 ) == nterm->value - table->token_count;
+        }
+
+        if ( ! skipped )
+        {
+            const char* name = _automata->syntax->source->text( nterm->name );
+            _errors->warning( nterm->name.sloc, "lazy nonterminal '%s' is never skipped", name );
+        }
+    }
+
+    for ( int token = 0; token < table->token_count; ++token )
+    {
+        const std::vector< int >& states = lazy_states.at( token );
+        table->lazy_index.push_back( (int)table->lazy_states.size() / 3 );
+        table->lazy_states.insert( table->lazy_states.end(), states.begin(), states.end() );
+    }
+    table->lazy_index.push_back( (int)table->lazy_states.size() / 3 );
     
     return table;
 }
@@ -297,6 +546,24 @@ void actions::build_actions( state* s )
     {
         for ( terminal* lookahead : reduction->lookahead )
         {
+            // The nonterminal may be restricted from being followed by the
+            // lookahead, in which case it never reduces on it.
+            const std::vector< terminal* >& restricts = reduction->drule->nterm->restricts;
+            if ( std::find( restricts.begin(), restricts.end(), lookahead ) != restricts.end() )
+            {
+                if ( _expected_info )
+                {
+                    _errors->info
+                    (
+                        rule_location( reduction->drule ),
+                        "reduce %s on %s removed by follow restriction",
+                        source->text( reduction->drule->nterm->name ),
+                        source->text( lookahead->name )
+                    );
+                }
+                continue;
+            }
+
             action* action = &s->actions.at( lookahead->value );
             
             switch ( action->kind )
@@ -505,6 +772,63 @@ void actions::build_actions( state* s )
             }
         }
     }
+
+    // Rejected rules give way to the other actions in a conflict, unless
+    // every action in the conflict is rejected.
+    s->has_conflict = false;
+    for ( action& action : s->actions )
+    {
+        if ( action.kind != ACTION_CONFLICT )
+        {
+            continue;
+        }
+
+        conflict* cflict = action.cflict;
+        std::vector< reduction* > reduce;
+        for ( reduction* reduction : cflict->reduce )
+        {
+            if ( ! rejected( reduction->drule ) )
+            {
+                reduce.push_back( reduction );
+            }
+        }
+
+        if ( reduce.empty() && ! cflict->shift )
+        {
+            s->has_conflict = true;
+            continue;
+        }
+
+        for ( reduction* reduction : cflict->reduce )
+        {
+            if ( _expected_info && rejected( reduction->drule ) )
+            {
+                _errors->info
+                (
+                    rule_location( reduction->drule ),
+                    "conflict on %s resolved by rejecting reduce %s",
+                    source->text( cflict->term->name ),
+                    source->text( reduction->drule->nterm->name )
+                );
+            }
+        }
+
+        cflict->reduce = reduce;
+        if ( reduce.empty() )
+        {
+            action.kind = ACTION_SHIFT;
+            action.shift = cflict->shift;
+        }
+        else if ( reduce.size() == 1 && ! cflict->shift )
+        {
+            action.kind = ACTION_REDUCE;
+            action.reduce = reduce.front();
+        }
+        else
+        {
+            s->has_conflict = true;
+        }
+    }
 }
 
 int actions::rule_precedence( rule* r )
@@ -512,6 +836,20 @@ int actions::rule_precedence( rule* r )
     return r->precedence ? r->precedence->precedence : -1;
 }
 
+bool actions::rejected( rule* r )
+{
+    // Only rules matching a single terminal can be rejected.
+    const std::vector< terminal* >& rejects = r->nterm->rejects;
+    const location& loc = _automata->syntax->locations.at( r->lostart );
+    return r->locount == 2 && std::find( rejects.begin(), rejects.end(), loc.sym ) != rejects.end();
+}
+
+bool actions::accepts( state* s )
+{
+    const std::vector< state* >& accepts = _automata->accepts;
+    return std::find( accepts.begin(), accepts.end(), s ) != accepts.end();
+}
+
 srcloc actions::rule_location( rule* r )
 {
     size_t iloc = r->lostart;
@@ -534,8 +872,8 @@ void actions::traverse_rules( state* s )
     s->visited = _automata->visited;
     s->reachable = true;
     
-    // If this is the accept state, the start rule is reachable.
-    if ( s == _automata->accept )
+    // If this is an accept state, the start rule is reachable.
+    if ( accepts( s ) )
     {
         for ( reduction* reduce : s->reductions )
         {
@@ -633,6 +971,84 @@ void actions::traverse_reduce( state* s, reduction* reduce )
 
 
 
+int actions::fallback_action( action_table* table, int state, int token )
+{
+    // Follow fallbacks until a token has an action.
+    const int* row = table->actions.data() + state * table->token_count;
+    while ( row[ token ] == table->error_action && table->fallbacks.at( token ) != token )
+    {
+        token = table->fallbacks.at( token );
+    }
+    return row[ token ];
+}
+
+void actions::follow_action( action_table* table, const std::vector< state* >& states, int state, int token, int action, std::vector< bool >* follow, std::set< std::pair< int, int > >* visited )
+{
+    // Find the tokens which might follow the token if this action is taken.
+    // Reductions consider every path back from the state, so the set may
+    // include tokens which the parse would reject.
+    if ( ! visited->emplace( state, action ).second )
+    {
+        return;
+    }
+
+    if ( action < table->state_count )
+    {
+        // After a shift, any token with an action in the new state.
+        for ( int next = 0; next < table->token_count; ++next )
+        {
+            if ( fallback_action( table, action, next ) != table->error_action )
+            {
+                follow->at( next ) = true;
+            }
+        }
+    }
+    else if ( action < table->state_count + table->rule_count )
+    {
+        // Pop the rule's symbols, then continue from the state after the
+        // nonterminal in each state the pop might reach.
+        rule* rule = table->rules.at( action - table->state_count );
+        std::vector< ::state* > popped = { states.at( state ) };
+        for ( size_t i = 0; i < rule->locount - 1; ++i )
+        {
+            std::vector< ::state* > prev;
+            for ( ::state* s : popped )
+            {
+                for ( transition* trans : s->prev )
+                {
+                    if ( trans->prev->reachable && std::find( prev.begin(), prev.end(), trans->prev ) == prev.end() )
+                    {
+                        prev.push_back( trans->prev );
+                    }
+                }
+            }
+            popped = std::move( prev );
+        }
+
+        for ( ::state* s : popped )
+        {
+            for ( transition* trans : s->next )
+            {
+                if ( trans->sym == rule->nterm && trans->next->reachable )
+                {
+                    int next_state = trans->next->index;
+                    int next_action = fallback_action( table, next_state, token );
+                    follow_action( table, states, next_state, token, next_action, follow, visited );
+                }
+            }
+        }
+    }
+    else if ( action < table->accept_action )
+    {
+        // Any alternative of a conflict.
+        const int* conflict = table->conflicts.data() + ( action - table->state_count - table->rule_count );
+        for ( int i = 1; i < conflict[ 0 ]; ++i )
+        {
+            follow_action( table, states, state, token, conflict[ i ], follow, visited );
+        }
+    }
+}
+
 int actions::conflict_actval( action_table* table, conflict* conflict )
 {
     // Build conflict.
@@ -15,6 +15,7 @@
 
 
 #include <queue>
+#include <set>
 #include "errors.h"
 #include "automata.h"
 #include "compress.h"
@@ -50,6 +51,23 @@ struct action_table
 
     std::vector< int > actions;
     compressed_table_ptr compressed;
+
+    std::vector< int > token_state_index;   // token -> start of list
+    std::vector< int > token_states;        // states which shift each token
+
+    int token_words;                        // 16-bit words per token set
+    std::vector< int > expected_tokens;     // state -> tokens with an action
+
+    std::vector< int > lazy_index;          // token -> start of list
+    std::vector< int > lazy_states;         // ( state, nterm, close ) opened by each token
+
+    std::vector< int > predicate_index;     // shift or reduce action -> start of list
+    std::vector< int > predicates;          // predicates guarding each action
+
+    std::vector< int > fallbacks;           // token -> token to retry with
+
+    std::vector< int > lookahead_index;     // state -> start of list
+    std::vector< int > lookaheads;          // ( token, next, action ) deciding conflicts
 };
 
 
@@ -92,12 +110,16 @@ private:
 
     void build_actions( state* s );
     int rule_precedence( rule* r );
+    bool rejected( rule* r );
+    bool accepts( state* s );
     srcloc rule_location( rule* r );
     
     void traverse_rules( state* s );
     void traverse_reduce( state* s, reduction* reduce );
     
     int conflict_actval( action_table* table, conflict* conflict );
+    int fallback_action( action_table* table, int state, int token );
+    void follow_action( action_table* table, const std::vector< state* >& states, int state, int token, int action, std::vector< bool >* follow, std::set< std::pair< int, int > >* visited );
     
     void report_conflicts( state* s );
     bool similar_conflict( conflict* a, conflict* b );
@@ -12,6 +12,7 @@
 
 #include "automata.h"
 #include <limits.h>
+#include <algorithm>
 
 
 /*
@@ -89,12 +90,18 @@ void automata::ensure_distances()
         return;
     }
     
-    // Traverse DFA from start state to work out distance from the start.
-    traverse_start( start, 0 );
+    // Traverse DFA from start states to work out distance from the start.
+    for ( state* s : starts )
+    {
+        traverse_start( s, 0 );
+    }
 
-    // Traverse DFA from accept state (and following rfrom links) to work
+    // Traverse DFA from accept states (and following rfrom links) to work
     // out distance to the accept state.
-    traverse_accept( accept, 0 );
+    for ( state* s : accepts )
+    {
+        traverse_accept( s, 0 );
+    }
 }
 
 
@@ -105,7 +112,8 @@ void automata::print_graph( bool rgoto )
     printf( "node [shape=plaintext]\n" );
     for ( const auto& state : states )
     {
-        bool start_accept = state.get() == start || state.get() == accept;
+        bool start_accept = std::find( starts.begin(), starts.end(), state.get() ) != starts.end()
+            || std::find( accepts.begin(), accepts.end(), state.get() ) != accepts.end();
         printf( "state%p [label=<<table border=\"%d\" cellborder=\"1\" cellspacing=\"0\">\n", state.get(), start_accept ? 4 : 0 );
         for ( size_t i = 0; i < state->closure->size; ++i )
         {
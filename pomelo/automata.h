@@ -76,6 +76,8 @@ struct automata
     syntax_ptr syntax;
     state* start;
     state* accept;
+    std::vector< state* > starts;   // start state for each entry symbol
+    std::vector< state* > accepts;  // accept state for each entry symbol
     std::vector< state_ptr > states;
     std::vector< transition_ptr > transitions;
     std::vector< reducefrom_ptr > reducefroms;
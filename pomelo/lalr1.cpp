@@ -133,12 +133,13 @@ automata_ptr lalr1::construct()
         }
     }
 
-    // Construct initial state.
+    // Construct a start state for each entry symbol.  The first is the
+    // initial state.
     for ( rule* rule : _automata->syntax->start->rules )
     {
         add_location( rule->lostart );
+        _automata->starts.push_back( close_state() );
     }
-    close_state();
     
     // While there are pending states, process them.
     while ( _pending.size() )
@@ -327,8 +328,12 @@ state* lalr1::close_state()
     const auto& loc = _automata->syntax->locations[ iloc ];
     if ( loc.drule->nterm == _automata->syntax->start && ! loc.sym )
     {
-        assert( ! _automata->accept );
-        _automata->accept = pstate;
+        if ( loc.drule == _automata->syntax->start->rules.front() )
+        {
+            assert( ! _automata->accept );
+            _automata->accept = pstate;
+        }
+        _automata->accepts.push_back( pstate );
     }
 
     _automata->states.push_back( std::move( nstate ) );
@@ -17,6 +17,7 @@
 #include "parser.h"
 #include "lalr1.h"
 #include "actions.h"
+#include "scanner.h"
 #include "write.h"
 
 
@@ -77,6 +78,14 @@ int main( int argc, const char* argv[] )
         return EXIT_FAILURE;
     }
     
+    scanner_ptr scanner = std::make_shared< ::scanner >( errors, syntax );
+    scanner_table_ptr scanner_table = scanner->construct();
+
+    if ( errors->has_error() )
+    {
+        return EXIT_FAILURE;
+    }
+
     action_table_ptr action_table = actions->build_action_table();
     goto_table_ptr goto_table = actions->build_goto_table();
     
@@ -85,6 +94,7 @@ int main( int argc, const char* argv[] )
             automata,
             action_table,
             goto_table,
+            scanner_table,
             options.source,
             options.output_h
         );
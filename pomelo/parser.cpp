@@ -11,6 +11,7 @@
 
 #include "parser.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 
@@ -80,18 +81,39 @@ void parser::parse( const char* path )
         terminal_ptr eoi = std::make_unique< terminal >( eoi_token );
         eoi->is_special     = true;
         
-        rule_ptr rule = std::make_unique< ::rule >( start.get() );
-        rule->lostart       = _syntax->locations.size();
-        rule->locount       = 3;
-        
-        _syntax->locations.push_back( { rule.get(), _syntax->start, start->name, NULL_TOKEN } );
-        _syntax->locations.push_back( { rule.get(), eoi.get(), eoi->name, NULL_TOKEN } );
-        _syntax->locations.push_back( { rule.get(), nullptr, NULL_TOKEN, NULL_TOKEN } );
-        
-        start->rules.push_back( rule.get() );
-        _syntax->rules.push_back( std::move( rule ) );
+        // The start symbol has a rule for each entry symbol.  The first is
+        // the root production.
+        std::vector< nonterminal* > entries;
+        entries.push_back( _syntax->start );
+        for ( nonterminal* entry : _syntax->entries )
+        {
+            if ( entry != _syntax->start )
+            {
+                entries.push_back( entry );
+            }
+            else if ( entry->saccept.size() )
+            {
+                const char* name = _syntax->source->text( entry->name );
+                _errors->error( entry->name.sloc, "accept code for root production '%s' must use %%parse_accept", name );
+            }
+        }
+
+        for ( nonterminal* entry : entries )
+        {
+            rule_ptr rule = std::make_unique< ::rule >( start.get() );
+            rule->lostart       = _syntax->locations.size();
+            rule->locount       = 3;
+
+            _syntax->locations.push_back( { rule.get(), entry, start->name, NULL_TOKEN, false, -1 } );
+            _syntax->locations.push_back( { rule.get(), eoi.get(), eoi->name, NULL_TOKEN, false, -1 } );
+            _syntax->locations.push_back( { rule.get(), nullptr, NULL_TOKEN, NULL_TOKEN, false, -1 } );
+
+            start->rules.push_back( rule.get() );
+            _syntax->rules.push_back( std::move( rule ) );
+        }
         
         _syntax->start = start.get();
+        _syntax->entries.assign( entries.begin() + 1, entries.end() );
         _syntax->terminals.emplace( eoi->name, std::move( eoi ) );
         _syntax->nonterminals.emplace( start->name, std::move( start ) );
     }
@@ -116,7 +138,110 @@ void parser::parse( const char* path )
             );
         }
     }
+
+    // Check that lazy nonterminals are bounded by their delimiters.
+    for ( const auto& entry : _syntax->nonterminals )
+    {
+        nonterminal* nterm = entry.second.get();
+        if ( ! nterm->lspecified )
+        {
+            continue;
+        }
+
+        // Skipped regions never produce events or tree nodes.
+        if ( _syntax->on_shift.specified || _syntax->on_reduce.specified || _syntax->syntax_tree.specified )
+        {
+            _errors->error
+            (
+                nterm->name.sloc,
+                "lazy nonterminal '%s' cannot be used with %%on_shift, %%on_reduce, or %%syntax_tree",
+                _syntax->source->text( nterm->name )
+            );
+        }
+
+        for ( rule* rule : nterm->rules )
+        {
+            const location* l = &_syntax->locations.at( rule->lostart );
+            if ( rule->locount < 3 || l[ 0 ].sym != nterm->lopen || l[ rule->locount - 2 ].sym != nterm->lclose )
+            {
+                _errors->error
+                (
+                    rule->locount > 1 ? l[ 0 ].stoken.sloc : nterm->name.sloc,
+                    "rule for lazy nonterminal '%s' must begin with '%s' and end with '%s'",
+                    _syntax->source->text( nterm->name ),
+                    _syntax->source->text( nterm->lopen->name ),
+                    _syntax->source->text( nterm->lclose->name )
+                );
+            }
+        }
+    }
     
+    // Check that fallbacks do not loop.
+    for ( const auto& entry : _syntax->terminals )
+    {
+        terminal* term = entry.second.get();
+        terminal* fallback = term->fallback;
+        for ( size_t i = 0; fallback && fallback != term && i < _syntax->terminals.size(); ++i )
+        {
+            fallback = fallback->fallback;
+        }
+
+        if ( fallback )
+        {
+            const char* name = _syntax->source->text( term->name );
+            _errors->error( term->name.sloc, "%%fallback for terminal '%s' is circular", name );
+        }
+    }
+
+    // Check that each rejected terminal has a rule to reject.
+    for ( const auto& entry : _syntax->nonterminals )
+    {
+        nonterminal* nterm = entry.second.get();
+        for ( terminal* term : nterm->rejects )
+        {
+            bool matched = std::any_of
+            (
+                nterm->rules.begin(),
+                nterm->rules.end(),
+                [&]( rule* rule ) { return rule->locount == 2 && _syntax->locations.at( rule->lostart ).sym == term; }
+            );
+
+            if ( ! matched )
+            {
+                _errors->error
+                (
+                    nterm->name.sloc,
+                    "nonterminal '%s' has no rule '%s .' to reject",
+                    _syntax->source->text( nterm->name ),
+                    _syntax->source->text( term->name )
+                );
+            }
+        }
+    }
+
+    // Repairs change the number of tokens, so cannot be used with features
+    // which record token positions.
+    if ( _syntax->error_repair.specified )
+    {
+        bool lazy = std::any_of
+        (
+            _syntax->nonterminals.begin(),
+            _syntax->nonterminals.end(),
+            []( const auto& entry ) { return entry.second->lspecified; }
+        );
+
+        if ( lazy || _syntax->on_shift.specified || _syntax->on_reduce.specified || _syntax->syntax_tree.specified )
+        {
+            _errors->error( _syntax->error_repair.keyword.sloc, "%%error_repair cannot be used with %%lazy, %%on_shift, %%on_reduce, or %%syntax_tree" );
+        }
+    }
+
+    // Tree nodes and events both replace symbol values.
+    if ( _syntax->syntax_tree.specified && ( _syntax->on_shift.specified || _syntax->on_reduce.specified ) )
+    {
+        _errors->error( _syntax->syntax_tree.keyword.sloc, "%%syntax_tree cannot be used with %%on_shift or %%on_reduce" );
+    }
+
     // Give all symbols a value.
     std::vector< symbol* > symbols;
     for ( const auto& tsym : _syntax->terminals )
@@ -200,6 +325,34 @@ void parser::parse_directive()
     {
         directive = &_syntax->error_report;
     }
+    else if ( strcmp( text, "error_repair" ) == 0 )
+    {
+        directive = &_syntax->error_repair;
+    }
+    else if ( strcmp( text, "parse_accept" ) == 0 )
+    {
+        directive = &_syntax->parse_accept;
+    }
+    else if ( strcmp( text, "writer_type" ) == 0 )
+    {
+        directive = &_syntax->writer_type;
+    }
+    else if ( strcmp( text, "reader_type" ) == 0 )
+    {
+        directive = &_syntax->reader_type;
+    }
+    else if ( strcmp( text, "lexer" ) == 0 )
+    {
+        directive = &_syntax->lexer;
+    }
+    else if ( strcmp( text, "on_shift" ) == 0 )
+    {
+        directive = &_syntax->on_shift;
+    }
+    else if ( strcmp( text, "on_reduce" ) == 0 )
+    {
+        directive = &_syntax->on_reduce;
+    }
     else if ( strcmp( text, "left" ) == 0 )
     {
         parse_precedence( ASSOC_LEFT );
@@ -215,6 +368,61 @@ void parser::parse_directive()
         parse_precedence( ASSOC_NONASSOC );
         return;
     }
+    else if ( strcmp( text, "fallback" ) == 0 )
+    {
+        parse_fallback();
+        return;
+    }
+    else if ( strcmp( text, "lazy" ) == 0 )
+    {
+        parse_lazy( false );
+        return;
+    }
+    else if ( strcmp( text, "memoize" ) == 0 )
+    {
+        parse_lazy( true );
+        return;
+    }
+    else if ( strcmp( text, "start" ) == 0 )
+    {
+        parse_start();
+        return;
+    }
+    else if ( strcmp( text, "stop_after" ) == 0 )
+    {
+        parse_stop_after();
+        return;
+    }
+    else if ( strcmp( text, "yield" ) == 0 )
+    {
+        parse_yield();
+        return;
+    }
+    else if ( strcmp( text, "follow_restrict" ) == 0 )
+    {
+        parse_filter( false );
+        return;
+    }
+    else if ( strcmp( text, "reject" ) == 0 )
+    {
+        parse_filter( true );
+        return;
+    }
+    else if ( strcmp( text, "syntax_tree" ) == 0 )
+    {
+        parse_syntax_tree();
+        return;
+    }
+    else if ( strcmp( text, "token" ) == 0 )
+    {
+        parse_pattern( false );
+        return;
+    }
+    else if ( strcmp( text, "skip" ) == 0 )
+    {
+        parse_pattern( true );
+        return;
+    }
     else
     {
         expected( "directive" );
@@ -268,6 +476,272 @@ void parser::parse_precedence( associativity associativity )
     }
 }
 
+void parser::parse_fallback()
+{
+    next();
+    if ( _lexed != TOKEN || ! terminal_token( _token ) )
+    {
+        expected( "terminal symbol" );
+        return;
+    }
+
+    terminal* fallback = declare_terminal( _token );
+
+    next();
+    while ( true )
+    {
+        if ( _lexed == TOKEN && terminal_token( _token ) )
+        {
+            terminal* terminal = declare_terminal( _token );
+            if ( terminal->fallback )
+            {
+                const char* name = _syntax->source->text( _token );
+                _errors->error( _token.sloc, "repeated %%fallback for terminal '%s'", name );
+            }
+            else
+            {
+                terminal->fallback = fallback;
+            }
+            next();
+        }
+        else if ( _lexed == '.' )
+        {
+            next();
+            break;
+        }
+        else
+        {
+            expected( "terminal symbol or '.'" );
+            break;
+        }
+    }
+}
+
+void parser::parse_lazy( bool memoize )
+{
+    next();
+    if ( _lexed != TOKEN || terminal_token( _token ) )
+    {
+        expected( "nonterminal symbol" );
+        return;
+    }
+
+    nonterminal* nonterminal = declare_nonterminal( _token );
+    if ( nonterminal->lspecified )
+    {
+        const char* name = _syntax->source->text( _token );
+        _errors->error( _token.sloc, "repeated %%lazy or %%memoize for nonterminal '%s'", name );
+    }
+
+    // Opening and closing delimiters.
+    terminal* delimiters[ 2 ] = { nullptr, nullptr };
+    for ( size_t i = 0; i < 2; ++i )
+    {
+        next();
+        if ( _lexed != TOKEN || ! terminal_token( _token ) )
+        {
+            expected( "terminal symbol" );
+            return;
+        }
+        delimiters[ i ] = declare_terminal( _token );
+    }
+
+    // Memoized nonterminals are parsed when the region closes, so they have
+    // no placeholder.
+    file_line line = _syntax->source->source_location( _tloc );
+    if ( ! memoize )
+    {
+        next();
+        if ( _lexed != BLOCK )
+        {
+            expected( "placeholder code" );
+            return;
+        }
+        line = _syntax->source->source_location( _tloc );
+        nonterminal->lplace = _block;
+    }
+
+    nonterminal->lopen = delimiters[ 0 ];
+    nonterminal->lclose = delimiters[ 1 ];
+    nonterminal->lline = line.line;
+    nonterminal->lspecified = true;
+    nonterminal->memoize = memoize;
+    next();
+}
+
+void parser::parse_start()
+{
+    next();
+    if ( _lexed != TOKEN || terminal_token( _token ) )
+    {
+        expected( "nonterminal symbol" );
+        return;
+    }
+
+    nonterminal* nonterminal = declare_nonterminal( _token );
+    if ( nonterminal->sspecified )
+    {
+        const char* name = _syntax->source->text( _token );
+        _errors->error( _token.sloc, "repeated %%start for nonterminal '%s'", name );
+    }
+    else
+    {
+        _syntax->entries.push_back( nonterminal );
+        nonterminal->sspecified = true;
+    }
+
+    // Accept code is optional.
+    next();
+    if ( _lexed == BLOCK )
+    {
+        file_line line = _syntax->source->source_location( _tloc );
+        nonterminal->sline = line.line;
+        nonterminal->saccept = _block;
+        next();
+    }
+}
+
+void parser::parse_stop_after()
+{
+    next();
+    if ( _lexed != TOKEN || terminal_token( _token ) )
+    {
+        expected( "nonterminal symbol" );
+        return;
+    }
+
+    nonterminal* nonterminal = declare_nonterminal( _token );
+    nonterminal->stops = true;
+    next();
+}
+
+void parser::parse_yield()
+{
+    next();
+    if ( _lexed != TOKEN || terminal_token( _token ) )
+    {
+        expected( "nonterminal symbol" );
+        return;
+    }
+
+    nonterminal* nonterminal = declare_nonterminal( _token );
+    nonterminal->yields = true;
+    next();
+}
+
+void parser::parse_filter( bool reject )
+{
+    next();
+    if ( _lexed != TOKEN || terminal_token( _token ) )
+    {
+        expected( "nonterminal symbol" );
+        return;
+    }
+
+    nonterminal* nonterminal = declare_nonterminal( _token );
+    std::vector< terminal* >* terminals = reject ? &nonterminal->rejects : &nonterminal->restricts;
+
+    next();
+    while ( true )
+    {
+        if ( _lexed == TOKEN && terminal_token( _token ) )
+        {
+            terminals->push_back( declare_terminal( _token ) );
+            next();
+        }
+        else if ( _lexed == '.' )
+        {
+            next();
+            break;
+        }
+        else
+        {
+            expected( "terminal symbol or '.'" );
+            break;
+        }
+    }
+}
+
+void parser::parse_syntax_tree()
+{
+    // There is no code block.
+    if ( _syntax->syntax_tree.specified )
+    {
+        _errors->error( _tloc, "repeated directive '%%syntax_tree'" );
+    }
+
+    _syntax->syntax_tree.keyword = _token;
+    _syntax->syntax_tree.specified = true;
+    next();
+}
+
+void parser::parse_pattern( bool skip )
+{
+    // Skipped text has no terminal.
+    terminal* term = nullptr;
+    if ( ! skip )
+    {
+        next();
+        if ( _lexed != TOKEN || ! terminal_token( _token ) )
+        {
+            expected( "terminal symbol" );
+            return;
+        }
+
+        term = declare_terminal( _token );
+        for ( const pattern& p : _syntax->patterns )
+        {
+            if ( p.term == term )
+            {
+                const char* name = _syntax->source->text( _token );
+                _errors->error( _token.sloc, "repeated %%token for terminal '%s'", name );
+                break;
+            }
+        }
+    }
+
+    next();
+    if ( _lexed != '/' )
+    {
+        expected( "pattern" );
+        return;
+    }
+
+    pattern p = { term, "", _tloc };
+    if ( read_pattern( &p.regex ) )
+    {
+        _syntax->patterns.push_back( p );
+    }
+    next();
+}
+
+bool parser::read_pattern( std::string* regex )
+{
+    // The pattern ends at the next '/' which is not escaped.
+    bool escaped = false;
+    while ( true )
+    {
+        int c = fgetc( _file );
+        _sloc += 1;
+
+        if ( c == '\r' || c == '\n' || c == EOF )
+        {
+            ungetc( c, _file );
+            _sloc -= 1;
+            _errors->error( _tloc, "unterminated pattern" );
+            return false;
+        }
+
+        if ( c == '/' && ! escaped )
+        {
+            return true;
+        }
+
+        escaped = ! escaped && c == '\\';
+        regex->push_back( c );
+    }
+}
+
 void parser::parse_nonterminal()
 {
     nonterminal* nonterminal = declare_nonterminal( _token );
@@ -352,16 +826,25 @@ void parser::parse_rule( nonterminal* nonterminal )
     while ( true )
     {
         bool conflicts = false;
+        int predicate = -1;
         if ( _lexed == '!' )
         {
             conflicts = true;
             next();
+
+            // A conflict marker can have a predicate.
+            if ( _lexed == BLOCK )
+            {
+                predicate = (int)_syntax->predicates.size();
+                _syntax->predicates.push_back( _block );
+                next();
+            }
         }
     
         if ( _lexed == TOKEN )
         {
             symbol* symbol = declare_symbol( _token );
-            location l = { rule.get(), symbol, _token, NULL_TOKEN, conflicts };
+            location l = { rule.get(), symbol, _token, NULL_TOKEN, conflicts, predicate };
             
             if ( l.sym->is_terminal && ! rule->precedence )
             {
@@ -398,10 +881,11 @@ void parser::parse_rule( nonterminal* nonterminal )
         }
         else if ( _lexed == '.' )
         {
-            location l = { rule.get(), nullptr, _token, NULL_TOKEN, false };
+            location l = { rule.get(), nullptr, _token, NULL_TOKEN, false, -1 };
             _syntax->locations.push_back( l );
             rule->locount += 1;
             rule->conflicts = conflicts;
+            rule->predicate = predicate;
 
             next();
             break;
@@ -441,6 +925,28 @@ void parser::parse_rule( nonterminal* nonterminal )
         }
     }
 
+    if ( _lexed == '%' )
+    {
+        next();
+        if ( _lexed == TOKEN && strcmp( _syntax->source->text( _token ), "dprec" ) == 0 )
+        {
+            next();
+            if ( _lexed == NUMBER && atoi( _block.c_str() ) > 0 && atoi( _block.c_str() ) < 32768 )
+            {
+                rule->dprec = atoi( _block.c_str() );
+                next();
+            }
+            else
+            {
+                expected( "priority between 1 and 32767" );
+            }
+        }
+        else
+        {
+            expected( "'%dprec'" );
+        }
+    }
+
     if ( _lexed == BLOCK )
     {
         file_line line = _syntax->source->source_location( _tloc );
@@ -464,6 +970,15 @@ bool parser::terminal_token( token token )
 
 symbol* parser::declare_symbol( token token )
 {
+    // The error symbol is a special terminal used for error recovery.
+    if ( strcmp( _syntax->source->text( token ), "error" ) == 0 )
+    {
+        terminal* error = declare_terminal( token );
+        error->is_special = true;
+        _syntax->error = error;
+        return error;
+    }
+
     if ( terminal_token( token ) )
     {
         return declare_terminal( token );
@@ -490,6 +1005,11 @@ terminal* parser::declare_terminal( token token )
 
 nonterminal* parser::declare_nonterminal( token token )
 {
+    if ( strcmp( _syntax->source->text( token ), "error" ) == 0 )
+    {
+        _errors->error( token.sloc, "'error' is reserved for error recovery" );
+    }
+
     auto i = _syntax->nonterminals.find( token );
     if ( i != _syntax->nonterminals.end() )
     {
@@ -671,6 +1191,22 @@ void parser::next()
             _token = _syntax->source->new_token( _tloc, _block );
             return;
         }
+        else if ( c >= '0' && c <= '9' )
+        {
+            _block.clear();
+            while ( c >= '0' && c <= '9' )
+            {
+                _block.push_back( c );
+                c = fgetc( _file );
+                _sloc += 1;
+            }
+
+            ungetc( c, _file );
+            _sloc -= 1;
+
+            _lexed = NUMBER;
+            return;
+        }
         else if ( c == '.' )
         {
             _lexed = '.';
@@ -709,6 +1245,12 @@ void parser::expected( const char* expected )
     {
         message += "code block";
     }
+    else if ( _lexed == NUMBER )
+    {
+        message += "'";
+        message += _block;
+        message += "'";
+    }
     else
     {
         message += "'";
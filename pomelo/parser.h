@@ -38,9 +38,19 @@ private:
 
     static const int TOKEN = -2;
     static const int BLOCK = -3;
+    static const int NUMBER = -4;
 
     void parse_directive();
     void parse_precedence( associativity associativity );
+    void parse_fallback();
+    void parse_lazy( bool memoize );
+    void parse_start();
+    void parse_stop_after();
+    void parse_yield();
+    void parse_filter( bool reject );
+    void parse_syntax_tree();
+    void parse_pattern( bool skip );
+    bool read_pattern( std::string* regex );
     void parse_nonterminal();
     void parse_rule( nonterminal* nonterminal );
     
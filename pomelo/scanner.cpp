@@ -0,0 +1,583 @@
+//
+//  scanner.cpp
+//  pomelo
+//
+//  Created by Edmund Kapusniak on 19/10/2026.
+//  Copyright © 2026 Edmund Kapusniak.
+//
+//  Licensed under the MIT License. See LICENSE file in the project root for
+//  full license information.
+//
+
+
+#include "scanner.h"
+#include <assert.h>
+#include <algorithm>
+#include <map>
+
+
+scanner::scanner( errors_ptr errors, syntax_ptr syntax )
+    :   _errors( errors )
+    ,   _syntax( syntax )
+    ,   _pattern( nullptr )
+    ,   _index( 0 )
+{
+}
+
+scanner::~scanner()
+{
+}
+
+
+scanner_table_ptr scanner::construct()
+{
+    if ( _syntax->patterns.empty() )
+    {
+        return nullptr;
+    }
+
+    // Build an NFA whose start state has an epsilon edge to each pattern.
+    int start = new_state();
+    for ( size_t i = 0; i < _syntax->patterns.size(); ++i )
+    {
+        _pattern = &_syntax->patterns.at( i );
+        _index = 0;
+
+        fragment f;
+        if ( ! parse_alternation( &f ) )
+        {
+            continue;
+        }
+
+        if ( _index < _pattern->regex.size() )
+        {
+            _errors->error( _pattern->sloc + 1 + _index, "unmatched ')' in pattern" );
+            continue;
+        }
+
+        _nfa.at( f.end ).accept = (int)i;
+        _nfa.at( start ).epsilon.push_back( f.start );
+    }
+
+    if ( _errors->has_error() )
+    {
+        return nullptr;
+    }
+
+    // Bytes which are not distinguished by any transition share a class.
+    std::vector< int > classes( 256, 0 );
+    int class_count = 1;
+    for ( const nfa_state& state : _nfa )
+    {
+        if ( state.next == -1 )
+        {
+            continue;
+        }
+
+        std::map< std::pair< int, bool >, int > split;
+        for ( int b = 0; b < 256; ++b )
+        {
+            auto key = std::make_pair( classes[ b ], (bool)state.bytes[ b ] );
+            classes[ b ] = split.emplace( key, (int)split.size() ).first->second;
+        }
+        class_count = (int)split.size();
+    }
+
+    std::vector< int > sample( class_count );
+    for ( int b = 0; b < 256; ++b )
+    {
+        sample[ classes[ b ] ] = b;
+    }
+
+    // Subset construction.  Each DFA state is a set of NFA states.
+    std::vector< std::vector< int > > subsets;
+    std::map< std::vector< int >, int > lookup;
+    std::vector< int > next;
+
+    std::vector< int > initial = { start };
+    close( &initial );
+    lookup.emplace( initial, 0 );
+    subsets.push_back( initial );
+
+    for ( size_t d = 0; d < subsets.size(); ++d )
+    {
+        for ( int c = 0; c < class_count; ++c )
+        {
+            std::vector< int > target;
+            for ( int n : subsets[ d ] )
+            {
+                const nfa_state& state = _nfa.at( n );
+                if ( state.next != -1 && state.bytes[ sample[ c ] ] )
+                {
+                    target.push_back( state.next );
+                }
+            }
+
+            if ( target.empty() )
+            {
+                next.push_back( -1 );
+                continue;
+            }
+
+            close( &target );
+            auto i = lookup.emplace( target, (int)subsets.size() );
+            if ( i.second )
+            {
+                subsets.push_back( target );
+            }
+            next.push_back( i.first->second );
+        }
+    }
+
+    // Each DFA state accepts the first pattern it contains.
+    int count = (int)subsets.size();
+    std::vector< int > accept( count, -1 );
+    std::vector< bool > matched( _syntax->patterns.size(), false );
+    for ( int d = 0; d < count; ++d )
+    {
+        for ( int n : subsets[ d ] )
+        {
+            int a = _nfa.at( n ).accept;
+            if ( a != -1 && ( accept[ d ] == -1 || a < accept[ d ] ) )
+            {
+                accept[ d ] = a;
+            }
+        }
+
+        if ( accept[ d ] != -1 )
+        {
+            matched.at( accept[ d ] ) = true;
+        }
+    }
+
+    if ( accept[ 0 ] != -1 )
+    {
+        const pattern& p = _syntax->patterns.at( accept[ 0 ] );
+        _errors->error( p.sloc, "pattern matches empty text" );
+        return nullptr;
+    }
+
+    for ( size_t i = 0; i < matched.size(); ++i )
+    {
+        if ( ! matched[ i ] )
+        {
+            const pattern& p = _syntax->patterns.at( i );
+            _errors->warning( p.sloc, "pattern never matches, as earlier patterns match the same text" );
+        }
+    }
+
+    // Values accepted by each state.
+    scanner_table_ptr table = std::make_shared< scanner_table >();
+    table->skip_value = (int)_syntax->terminals.size();
+    table->none_value = table->skip_value + 1;
+
+    std::vector< int > values( count );
+    for ( int d = 0; d < count; ++d )
+    {
+        if ( accept[ d ] == -1 )
+        {
+            values[ d ] = table->none_value;
+        }
+        else
+        {
+            terminal* term = _syntax->patterns.at( accept[ d ] ).term;
+            values[ d ] = term ? term->value : table->skip_value;
+        }
+    }
+
+    // Minimize by splitting blocks of states until states in each block
+    // agree on their accepted value and the blocks of their transitions.
+    std::vector< int > block = values;
+    size_t block_count = 0;
+    while ( true )
+    {
+        std::map< std::vector< int >, int > signatures;
+        std::vector< int > refined( count );
+        for ( int d = 0; d < count; ++d )
+        {
+            std::vector< int > signature;
+            signature.reserve( 1 + class_count );
+            signature.push_back( block[ d ] );
+            for ( int c = 0; c < class_count; ++c )
+            {
+                int t = next[ d * class_count + c ];
+                signature.push_back( t != -1 ? block[ t ] : -1 );
+            }
+            refined[ d ] = signatures.emplace( signature, (int)signatures.size() ).first->second;
+        }
+
+        block = refined;
+        if ( signatures.size() == block_count )
+        {
+            break;
+        }
+        block_count = signatures.size();
+    }
+
+    // The start state is numbered first, so its block is zero.
+    assert( block[ 0 ] == 0 );
+    table->state_count = (int)block_count;
+    table->class_count = class_count;
+    table->classes = classes;
+    table->next.assign( block_count * class_count, table->state_count );
+    table->accept.assign( block_count, table->none_value );
+    for ( int d = 0; d < count; ++d )
+    {
+        for ( int c = 0; c < class_count; ++c )
+        {
+            int t = next[ d * class_count + c ];
+            table->next[ block[ d ] * class_count + c ] = t != -1 ? block[ t ] : table->state_count;
+        }
+        table->accept[ block[ d ] ] = values[ d ];
+    }
+
+    return table;
+}
+
+
+int scanner::new_state()
+{
+    _nfa.push_back( { std::bitset< 256 >(), -1, {}, -1 } );
+    return (int)_nfa.size() - 1;
+}
+
+bool scanner::parse_alternation( fragment* f )
+{
+    const std::string& regex = _pattern->regex;
+    if ( ! parse_sequence( f ) )
+    {
+        return false;
+    }
+
+    while ( _index < regex.size() && regex[ _index ] == '|' )
+    {
+        _index += 1;
+        fragment g;
+        if ( ! parse_sequence( &g ) )
+        {
+            return false;
+        }
+
+        fragment a = { new_state(), new_state() };
+        _nfa.at( a.start ).epsilon.push_back( f->start );
+        _nfa.at( a.start ).epsilon.push_back( g.start );
+        _nfa.at( f->end ).epsilon.push_back( a.end );
+        _nfa.at( g.end ).epsilon.push_back( a.end );
+        *f = a;
+    }
+
+    return true;
+}
+
+bool scanner::parse_sequence( fragment* f )
+{
+    const std::string& regex = _pattern->regex;
+    int empty = new_state();
+    *f = { empty, empty };
+
+    while ( _index < regex.size() && regex[ _index ] != '|' && regex[ _index ] != ')' )
+    {
+        fragment g;
+        if ( ! parse_repeat( &g ) )
+        {
+            return false;
+        }
+
+        _nfa.at( f->end ).epsilon.push_back( g.start );
+        f->end = g.end;
+    }
+
+    return true;
+}
+
+bool scanner::parse_repeat( fragment* f )
+{
+    const std::string& regex = _pattern->regex;
+    if ( ! parse_atom( f ) )
+    {
+        return false;
+    }
+
+    while ( _index < regex.size() )
+    {
+        char c = regex[ _index ];
+        if ( c != '*' && c != '+' && c != '?' )
+        {
+            break;
+        }
+        _index += 1;
+
+        fragment r = { new_state(), new_state() };
+        _nfa.at( r.start ).epsilon.push_back( f->start );
+        _nfa.at( f->end ).epsilon.push_back( r.end );
+        if ( c == '*' || c == '+' )
+        {
+            _nfa.at( f->end ).epsilon.push_back( f->start );
+        }
+        if ( c == '*' || c == '?' )
+        {
+            _nfa.at( r.start ).epsilon.push_back( r.end );
+        }
+        *f = r;
+    }
+
+    return true;
+}
+
+bool scanner::parse_atom( fragment* f )
+{
+    const std::string& regex = _pattern->regex;
+    assert( _index < regex.size() );
+    char c = regex[ _index ];
+
+    std::bitset< 256 > bytes;
+    if ( c == '(' )
+    {
+        _index += 1;
+        if ( ! parse_alternation( f ) )
+        {
+            return false;
+        }
+
+        if ( _index >= regex.size() || regex[ _index ] != ')' )
+        {
+            _errors->error( _pattern->sloc + 1 + _index, "expected ')' in pattern" );
+            return false;
+        }
+        _index += 1;
+        return true;
+    }
+    else if ( c == '*' || c == '+' || c == '?' )
+    {
+        _errors->error( _pattern->sloc + 1 + _index, "nothing to repeat in pattern" );
+        return false;
+    }
+    else if ( c == '[' )
+    {
+        _index += 1;
+        if ( ! parse_class( &bytes ) )
+        {
+            return false;
+        }
+    }
+    else if ( c == '\\' )
+    {
+        _index += 1;
+        if ( ! parse_escape( &bytes ) )
+        {
+            return false;
+        }
+    }
+    else if ( c == '.' )
+    {
+        _index += 1;
+        bytes.set();
+        bytes.reset( '\n' );
+    }
+    else
+    {
+        _index += 1;
+        bytes.set( (unsigned char)c );
+    }
+
+    *f = bytes_fragment( bytes );
+    return true;
+}
+
+bool scanner::parse_class( std::bitset< 256 >* bytes )
+{
+    const std::string& regex = _pattern->regex;
+    bool negate = false;
+    if ( _index < regex.size() && regex[ _index ] == '^' )
+    {
+        negate = true;
+        _index += 1;
+    }
+
+    // A ']' at the start of the class is part of it.
+    bool first = true;
+    while ( true )
+    {
+        if ( _index >= regex.size() )
+        {
+            _errors->error( _pattern->sloc + 1 + _index, "unterminated character class in pattern" );
+            return false;
+        }
+
+        char c = regex[ _index ];
+        if ( c == ']' && ! first )
+        {
+            _index += 1;
+            break;
+        }
+        first = false;
+
+        // Match a single byte or an escape.
+        std::bitset< 256 > item;
+        _index += 1;
+        if ( c == '\\' )
+        {
+            if ( ! parse_escape( &item ) )
+            {
+                return false;
+            }
+        }
+        else
+        {
+            item.set( (unsigned char)c );
+        }
+
+        // Ranges are between two single bytes.
+        if ( item.count() == 1 && _index + 1 < regex.size() && regex[ _index ] == '-' && regex[ _index + 1 ] != ']' )
+        {
+            size_t dash = _index;
+            _index += 1;
+
+            std::bitset< 256 > upper;
+            c = regex[ _index ];
+            _index += 1;
+            if ( c == '\\' )
+            {
+                if ( ! parse_escape( &upper ) )
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                upper.set( (unsigned char)c );
+            }
+
+            int lo = 0;
+            int hi = 0;
+            while ( ! item[ lo ] ) ++lo;
+            while ( hi < 256 && ! upper[ hi ] ) ++hi;
+            if ( upper.count() != 1 || hi < lo )
+            {
+                _errors->error( _pattern->sloc + 1 + dash, "invalid range in character class" );
+                return false;
+            }
+
+            for ( int b = lo; b <= hi; ++b )
+            {
+                item.set( b );
+            }
+        }
+
+        *bytes |= item;
+    }
+
+    if ( negate )
+    {
+        bytes->flip();
+    }
+
+    return true;
+}
+
+static int hex_digit( char c )
+{
+    if ( c >= '0' && c <= '9' )
+        return c - '0';
+    if ( c >= 'a' && c <= 'f' )
+        return c - 'a' + 10;
+    if ( c >= 'A' && c <= 'F' )
+        return c - 'A' + 10;
+    return -1;
+}
+
+bool scanner::parse_escape( std::bitset< 256 >* bytes )
+{
+    const std::string& regex = _pattern->regex;
+    if ( _index >= regex.size() )
+    {
+        _errors->error( _pattern->sloc + _index, "incomplete escape in pattern" );
+        return false;
+    }
+
+    char c = regex[ _index ];
+    _index += 1;
+    switch ( c )
+    {
+    case 'n': bytes->set( '\n' ); break;
+    case 'r': bytes->set( '\r' ); break;
+    case 't': bytes->set( '\t' ); break;
+    case 'f': bytes->set( '\f' ); break;
+    case 'v': bytes->set( '\v' ); break;
+    case '0': bytes->set( 0 ); break;
+
+    case 'd':
+        for ( int b = '0'; b <= '9'; ++b )
+            bytes->set( b );
+        break;
+
+    case 'w':
+        for ( int b = '0'; b <= '9'; ++b )
+            bytes->set( b );
+        for ( int b = 'a'; b <= 'z'; ++b )
+            bytes->set( b );
+        for ( int b = 'A'; b <= 'Z'; ++b )
+            bytes->set( b );
+        bytes->set( '_' );
+        break;
+
+    case 's':
+        for ( char b : { ' ', '\t', '\r', '\n', '\f', '\v' } )
+            bytes->set( b );
+        break;
+
+    case 'x':
+    {
+        int hi = _index < regex.size() ? hex_digit( regex[ _index ] ) : -1;
+        int lo = _index + 1 < regex.size() ? hex_digit( regex[ _index + 1 ] ) : -1;
+        if ( hi == -1 || lo == -1 )
+        {
+            _errors->error( _pattern->sloc + 1 + _index, "expected two hex digits in pattern" );
+            return false;
+        }
+        _index += 2;
+        bytes->set( hi * 16 + lo );
+        break;
+    }
+
+    default:
+        bytes->set( (unsigned char)c );
+        break;
+    }
+
+    return true;
+}
+
+scanner::fragment scanner::bytes_fragment( const std::bitset< 256 >& bytes )
+{
+    fragment f = { new_state(), new_state() };
+    _nfa.at( f.start ).bytes = bytes;
+    _nfa.at( f.start ).next = f.end;
+    return f;
+}
+
+void scanner::close( std::vector< int >* states )
+{
+    // Follow epsilon edges, then sort so that equal sets compare equal.
+    std::vector< bool > visited( _nfa.size(), false );
+    for ( int n : *states )
+    {
+        visited[ n ] = true;
+    }
+
+    for ( size_t i = 0; i < states->size(); ++i )
+    {
+        for ( int e : _nfa.at( states->at( i ) ).epsilon )
+        {
+            if ( ! visited[ e ] )
+            {
+                visited[ e ] = true;
+                states->push_back( e );
+            }
+        }
+    }
+
+    std::sort( states->begin(), states->end() );
+    states->erase( std::unique( states->begin(), states->end() ), states->end() );
+}
+
@@ -0,0 +1,105 @@
+//
+//  scanner.h
+//  pomelo
+//
+//  Created by Edmund Kapusniak on 19/10/2026.
+//  Copyright © 2026 Edmund Kapusniak.
+//
+//  Licensed under the MIT License. See LICENSE file in the project root for
+//  full license information.
+//
+
+
+#ifndef SCANNER_H
+#define SCANNER_H
+
+
+#include <memory>
+#include <vector>
+#include <bitset>
+#include "syntax.h"
+
+
+struct scanner_table;
+class scanner;
+
+typedef std::shared_ptr< scanner_table > scanner_table_ptr;
+typedef std::shared_ptr< scanner > scanner_ptr;
+
+
+
+/*
+    Tables for a DFA which matches the patterns given to terminals.  Bytes
+    are mapped to classes, and each state has a row of transitions indexed by
+    class.  State 0 is the start state, and state_count is the dead state.
+    Each state accepts a token, or skip_value for text matching a %skip
+    pattern, or none_value if the text so far matches no pattern.
+*/
+
+struct scanner_table
+{
+    int state_count;
+    int class_count;
+    int skip_value;
+    int none_value;
+    std::vector< int > classes; // class of each byte.
+    std::vector< int > next;    // next state for each state and class.
+    std::vector< int > accept;  // value accepted in each state.
+};
+
+
+
+/*
+    Build a minimal DFA from the regular expressions in the grammar.  The
+    longest match wins, and of patterns matching the same text, the one
+    declared first wins.
+*/
+
+class scanner
+{
+public:
+
+    scanner( errors_ptr errors, syntax_ptr syntax );
+    ~scanner();
+
+    scanner_table_ptr construct();
+
+
+private:
+
+    struct nfa_state
+    {
+        std::bitset< 256 > bytes;
+        int next;
+        std::vector< int > epsilon;
+        int accept;
+    };
+
+    struct fragment
+    {
+        int start;
+        int end;
+    };
+
+    int new_state();
+    bool parse_alternation( fragment* f );
+    bool parse_sequence( fragment* f );
+    bool parse_repeat( fragment* f );
+    bool parse_atom( fragment* f );
+    bool parse_class( std::bitset< 256 >* bytes );
+    bool parse_escape( std::bitset< 256 >* bytes );
+    fragment bytes_fragment( const std::bitset< 256 >& bytes );
+    void close( std::vector< int >* states );
+
+    errors_ptr _errors;
+    syntax_ptr _syntax;
+    std::vector< nfa_state > _nfa;
+    const pattern* _pattern;
+    size_t _index;
+
+};
+
+
+
+#endif
+
@@ -65,7 +65,7 @@ left_context_ptr left_search::generate()
     
         // If the target and start nodes are the same, first minimal left
         // context is the empty stack.
-        if ( _target == _automata->start )
+        if ( _target->start_distance == 0 )
         {
             return std::make_shared< left_context >();
         }
@@ -124,7 +124,7 @@ left_context_ptr left_search::generate()
 left_context_ptr left_search::generate_route( left_node* node )
 {
     // Find route that links towards start node.
-    while ( node->xstate != _automata->start )
+    while ( node->xstate->start_distance > 0 )
     {
         for ( size_t i = 0; i < node->xstate->prev.size(); ++i )
         {
@@ -24,6 +24,7 @@ directive::directive()
 syntax::syntax( source_ptr source )
     :   source( source )
     ,   start( nullptr )
+    ,   error( nullptr )
 {
 }
 
@@ -43,6 +44,22 @@ void syntax::print()
     printf( "%%token_prefix {%s}\n", token_prefix.text.c_str() );
     printf( "%%nterm_prefix {%s}\n", nterm_prefix.text.c_str() );
     printf( "%%error_report {%s}\n", error_report.text.c_str() );
+    if ( error_repair.specified )
+    {
+        printf( "%%error_repair {%s}\n", error_repair.text.c_str() );
+    }
+
+    for ( const pattern& p : patterns )
+    {
+        if ( p.term )
+        {
+            printf( "%%token %s /%s/\n", source->text( p.term->name ), p.regex.c_str() );
+        }
+        else
+        {
+            printf( "%%skip /%s/\n", p.regex.c_str() );
+        }
+    }
     
     for ( const auto& entry : terminals )
     {
@@ -56,6 +73,11 @@ void syntax::print()
             tsym->precedence,
             tsym->associativity
         );
+
+        if ( tsym->fallback )
+        {
+            printf( "    %%fallback %s\n", source->text( tsym->fallback->name ) );
+        }
     }
     
     for ( const auto& entry : nonterminals )
@@ -74,6 +96,61 @@ void syntax::print()
         {
             printf( "    @{%s}\n", nsym->gmerge.c_str() );
         }
+
+        if ( nsym->lspecified && nsym->memoize )
+        {
+            printf
+            (
+                "    %%memoize %s %s\n",
+                source->text( nsym->lopen->name ),
+                source->text( nsym->lclose->name )
+            );
+        }
+        else if ( nsym->lspecified )
+        {
+            printf
+            (
+                "    %%lazy %s %s {%s}\n",
+                source->text( nsym->lopen->name ),
+                source->text( nsym->lclose->name ),
+                nsym->lplace.c_str()
+            );
+        }
+
+        if ( nsym->sspecified )
+        {
+            printf( "    %%start {%s}\n", nsym->saccept.c_str() );
+        }
+
+        if ( nsym->stops )
+        {
+            printf( "    %%stop_after\n" );
+        }
+
+        if ( nsym->restricts.size() )
+        {
+            printf( "    %%follow_restrict" );
+            for ( terminal* term : nsym->restricts )
+            {
+                printf( " %s", source->text( term->name ) );
+            }
+            printf( "\n" );
+        }
+
+        if ( nsym->rejects.size() )
+        {
+            printf( "    %%reject" );
+            for ( terminal* term : nsym->rejects )
+            {
+                printf( " %s", source->text( term->name ) );
+            }
+            printf( "\n" );
+        }
+
+        if ( nsym->yields )
+        {
+            printf( "    %%yield\n" );
+        }
         
         printf( "[\n" );
         for ( rule* rule : nsym->rules )
@@ -86,6 +163,10 @@ void syntax::print()
                 {
                     printf( "! " );
                 }
+                if ( l.predicate != -1 )
+                {
+                    printf( "{%s} ", predicates.at( l.predicate ).c_str() );
+                }
                 if ( l.sym )
                 {
                     printf( "%s", source->text( l.sym->name ) );
@@ -100,6 +181,10 @@ void syntax::print()
                     {
                         printf( "! " );
                     }
+                    if ( rule->predicate != -1 )
+                    {
+                        printf( "{%s} ", predicates.at( rule->predicate ).c_str() );
+                    }
                     printf( "." );
                 }
                 printf( " " );
@@ -114,6 +199,10 @@ void syntax::print()
                     prec->precedence
                 );
             }
+            if ( rule->dprec )
+            {
+                printf( "%%dprec %d ", rule->dprec );
+            }
             printf( "{%s}\n", rule->action.c_str() );
         }
         
@@ -136,6 +225,7 @@ terminal::terminal( token name )
     :   symbol( name, true )
     ,   precedence( -1 )
     ,   associativity( ASSOC_NONE )
+    ,   fallback( nullptr )
 {
 }
 
@@ -143,6 +233,15 @@ terminal::terminal( token name )
 nonterminal::nonterminal( token name )
     :   symbol( name, false )
     ,   gspecified( false )
+    ,   lopen( nullptr )
+    ,   lclose( nullptr )
+    ,   lline( -1 )
+    ,   lspecified( false )
+    ,   memoize( false )
+    ,   sline( -1 )
+    ,   sspecified( false )
+    ,   stops( false )
+    ,   yields( false )
     ,   defined( false )
     ,   erasable( false )
 {
@@ -160,5 +259,7 @@ rule::rule( nonterminal* nterm )
     ,   actspecified( false )
     ,   conflicts( false )
     ,   reachable( false )
+    ,   dprec( 0 )
+    ,   predicate( -1 )
 {
 }
@@ -23,6 +23,7 @@
 
 struct directive;
 struct location;
+struct pattern;
 struct syntax;
 struct symbol;
 struct terminal;
@@ -60,6 +61,14 @@ struct location
     token           stoken;
     token           sparam;
     bool            conflicts;
+    int             predicate;
+};
+
+struct pattern
+{
+    terminal*       term;
+    std::string     regex;
+    srcloc          sloc;
 };
 
 struct syntax
@@ -79,11 +88,23 @@ struct syntax
     directive token_prefix;
     directive nterm_prefix;
     directive error_report;
+    directive error_repair;
+    directive parse_accept;
+    directive writer_type;
+    directive reader_type;
+    directive lexer;
+    directive on_shift;
+    directive on_reduce;
+    directive syntax_tree;
     nonterminal* start;
+    terminal* error;
+    std::vector< nonterminal* > entries;
     std::unordered_map< token, terminal_ptr > terminals;
     std::unordered_map< token, nonterminal_ptr > nonterminals;
     std::vector< rule_ptr > rules;
     std::vector< location > locations;
+    std::vector< pattern > patterns;
+    std::vector< std::string > predicates;
 };
 
 struct symbol
@@ -102,6 +123,7 @@ struct terminal : public symbol
 
     int             precedence      : ( sizeof( int ) * CHAR_BIT ) - 2;
     int             associativity   : 2;
+    terminal*       fallback;
 };
 
 struct nonterminal : public symbol
@@ -113,6 +135,19 @@ struct nonterminal : public symbol
     std::string     gmerge;
     int             gline;
     bool            gspecified;
+    terminal*       lopen;
+    terminal*       lclose;
+    std::string     lplace;
+    int             lline;
+    bool            lspecified;
+    bool            memoize;
+    std::string     saccept;
+    int             sline;
+    bool            sspecified;
+    bool            stops;
+    bool            yields;
+    std::vector< terminal* > restricts;
+    std::vector< terminal* > rejects;
     bool            defined;
     bool            erasable;
 };
@@ -132,6 +167,8 @@ struct rule
     bool            actspecified;
     bool            conflicts;
     bool            reachable;
+    int             dprec;
+    int             predicate;
 };
 
 
@@ -25,8 +25,13 @@
 
 #include "$(header)"
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
 #include <memory>
 #include <algorithm>
+#include <unordered_map>
+#include <thread>
+?(scanner)#include <string_view>
 
 $(include_source)
 
@@ -38,12 +43,18 @@ $(include_source)
 
 const int $(class_name)::START_STATE      = $(start_state);
 const int $(class_name)::TOKEN_COUNT      = $(token_count);
+const int $(class_name)::TOKEN_WORDS      = $(token_words);
 const int $(class_name)::NTERM_COUNT      = $(nterm_count);
 const int $(class_name)::STATE_COUNT      = $(state_count);
 const int $(class_name)::RULE_COUNT       = $(rule_count);
 const int $(class_name)::CONFLICT_COUNT   = $(conflict_count);
 const int $(class_name)::ACCEPT_ACTION    = $(accept_action);
 const int $(class_name)::ERROR_ACTION     = $(error_action);
+?(error_token)const int $(class_name)::ERROR_TOKEN      = $(error_token);
+?(error_repair)const int $(class_name)::REPAIR_WINDOW    = $(repair_window);
+?(error_repair)const int $(class_name)::REPAIR_LIMIT     = $(repair_limit);
+const int $(class_name)::CHUNK_SIZE       = $(chunk_size);
+const int $(class_name)::GRAMMAR_HASH[]   = { $(grammar_hash) };
 
 const unsigned short $(class_name)::ACTION_DISPLACEMENT[] =
 {
@@ -85,6 +96,80 @@ const $(class_name)::rule_info $(class_name)::RULE[] =
 $(rule_table)
 };
 
+const $(class_name)::start_info $(class_name)::START_STATES[] =
+{
+    { $(start_nterm), $(start_state) },
+    { $$(entry_nterm), $$(entry_state) },
+};
+
+const unsigned short $(class_name)::TOKEN_STATE_INDEX[] =
+{
+$(token_state_index)
+};
+
+const unsigned short $(class_name)::TOKEN_STATES[] =
+{
+$(token_state_table)
+};
+
+const unsigned short $(class_name)::EXPECTED_TOKENS[] =
+{
+$(expected_table)
+};
+
+?(lazy)const unsigned short $(class_name)::LAZY_INDEX[] =
+?(lazy){
+?(lazy)$(lazy_index)
+?(lazy)};
+?(lazy)
+?(lazy)const $(class_name)::lazy_info $(class_name)::LAZY_STATES[] =
+?(lazy){
+?(lazy)$(lazy_table)
+?(lazy)};
+?(predicates)
+?(predicates)const unsigned short $(class_name)::PREDICATE_INDEX[] =
+?(predicates){
+?(predicates)$(predicate_index)
+?(predicates)};
+?(predicates)
+?(predicates)const unsigned short $(class_name)::PREDICATES[] =
+?(predicates){
+?(predicates)$(predicate_table)
+?(predicates)};
+?(fallback)
+?(fallback)const unsigned short $(class_name)::FALLBACK[] =
+?(fallback){
+?(fallback)$(fallback_table)
+?(fallback)};
+?(lookahead)
+?(lookahead)const unsigned short $(class_name)::LOOKAHEAD_INDEX[] =
+?(lookahead){
+?(lookahead)$(lookahead_index)
+?(lookahead)};
+?(lookahead)
+?(lookahead)const $(class_name)::lookahead_info $(class_name)::LOOKAHEAD[] =
+?(lookahead){
+?(lookahead)$(lookahead_table)
+?(lookahead)};
+?(scanner)
+?(scanner)const int $(class_name)::SCAN_STATE_COUNT = $(scan_state_count);
+?(scanner)const int $(class_name)::SCAN_CLASS_COUNT = $(scan_class_count);
+?(scanner)
+?(scanner)const unsigned char $(class_name)::SCAN_CLASS[] =
+?(scanner){
+?(scanner)$(scan_class_table)
+?(scanner)};
+?(scanner)
+?(scanner)const unsigned short $(class_name)::SCAN_NEXT[] =
+?(scanner){
+?(scanner)$(scan_next_table)
+?(scanner)};
+?(scanner)
+?(scanner)const unsigned short $(class_name)::SCAN_ACCEPT[] =
+?(scanner){
+?(scanner)$(scan_accept_table)
+?(scanner)};
+
 
 
 /*
@@ -96,6 +181,7 @@ const char* $(class_name)::symbol_name( int kind )
     switch ( kind )
     {
     case 0: return "$EOI";
+?(error_token)    case $(error_token): return "error";
     case $$(token_value): return "$$(token_name)";
     case $(token_count): return "$start";
     case $$(nterm_value): return "$$(nterm_name)";
@@ -126,6 +212,7 @@ public:
     ~value()                                { destroy(); }
     
     int state() const                       { return _state; }
+    int kind() const                        { return _kind; }
     template < typename T > T& get() const  { return *(T*)_storage; }
     template < typename T > T&& move()      { return std::move( *(T*)_storage ); }
     
@@ -179,11 +266,30 @@ private:
 
 
 
+/*
+    Values on the parser stack are stored in fixed-size chunks.  Each piece of
+    the stack owns a list of chunks, linked from the top of the piece down.
+    Chunks which are no longer in use are kept by the parser for reuse.
+*/
+
+struct $(class_name)::chunk
+{
+    chunk* prev;
+    int lower;
+    int upper;
+    std::aligned_storage_t< sizeof( value ), alignof( value ) > storage[ CHUNK_SIZE ];
+
+    value* values()                         { return (value*)storage; }
+    int size() const                        { return upper - lower; }
+};
+
+
+
 /*
     Rules.
 */
 
-$$(rule_type) $(class_name)::$$(rule_name)($$(rule_param)) { $$(rule_body) }
+?(actions)$$(rule_type) $(class_name)::$$(rule_name)($$(rule_param)) { $$(rule_body) }
 
 
 /*
@@ -193,6 +299,24 @@ $$(rule_type) $(class_name)::$$(rule_name)($$(rule_param)) { $$(rule_body) }
 $$(merge_type) $(class_name)::$$(merge_name)( const user_value& u, $$(merge_type)&& a, user_value&& v, $$(merge_type)&& b ) { $$(merge_body) }
 
 
+/*
+    Lazy placeholders.
+*/
+
+?(lazy)?(user_value)$$(lazy_type) $(class_name)::$$(lazy_name)( const user_value& u, const lazy_range& range ) { $$(lazy_body) }
+?(lazy)!(user_value)$$(lazy_type) $(class_name)::$$(lazy_name)( const lazy_range& range ) { $$(lazy_body) }
+
+
+/*
+    Predicates.
+*/
+
+?(user_value)?(token_type)bool $(class_name)::$$(pred_name)( const user_value& u, int token, const token_type& tokval ) { $$(pred_body) }
+?(user_value)!(token_type)bool $(class_name)::$$(pred_name)( const user_value& u, int token ) { $$(pred_body) }
+!(user_value)?(token_type)bool $(class_name)::$$(pred_name)( int token, const token_type& tokval ) { $$(pred_body) }
+!(user_value)!(token_type)bool $(class_name)::$$(pred_name)( int token ) { $$(pred_body) }
+
+
 /*
     Implementation of the parser.
 */
@@ -201,45 +325,823 @@ $$(merge_type) $(class_name)::$$(merge_name)( const user_value& u, $$(merge_type
 ?(user_value)    :   _anchor{ user_value(), -1, nullptr, &_anchor, &_anchor }
 !(user_value)$(class_name)::$(class_name)()
 !(user_value)    :   _anchor{ -1, nullptr, &_anchor, &_anchor }
+    ,   _free_pieces( nullptr )
+    ,   _free_stacks( nullptr )
+    ,   _free_chunks( nullptr )
+    ,   _speculation( nullptr )
+?(position)    ,   _position( 0 )
+?(lazy)    ,   _skip()
+?(stop_after)    ,   _done( false )
+?(error_token)    ,   _recovering( 0 )
+?(error_repair)    ,   _repair()
+    ,   _step()
+?(lookahead)    ,   _ahead()
+{
+?(user_value)    reset( u );
+!(user_value)    reset();
+}
+
+$(class_name)::$(class_name)( fork_tag )
+?(user_value)    :   _anchor{ user_value(), -1, nullptr, &_anchor, &_anchor }
+!(user_value)    :   _anchor{ -1, nullptr, &_anchor, &_anchor }
+    ,   _free_pieces( nullptr )
+    ,   _free_stacks( nullptr )
+    ,   _free_chunks( nullptr )
+    ,   _speculation( nullptr )
+?(position)    ,   _position( 0 )
+?(lazy)    ,   _skip()
+?(stop_after)    ,   _done( false )
+?(error_token)    ,   _recovering( 0 )
+?(error_repair)    ,   _repair()
+    ,   _step()
+?(lookahead)    ,   _ahead()
 {
-    piece* p = new piece { 1, nullptr };
-?(user_value)    stack* s = new stack { u, START_STATE, p, &_anchor, &_anchor };
-!(user_value)    stack* s = new stack { START_STATE, p, &_anchor, &_anchor };
-    _anchor.next = s;
-    _anchor.prev = s;
 }
 
 $(class_name)::~$(class_name)()
 {
+    // Release fragments left by a speculative parse.
+    if ( _speculation )
+    {
+        for ( segment& seg : _speculation->segments )
+        {
+            for ( fragment& f : seg.fragments )
+            {
+                release_piece( f.head );
+            }
+        }
+    }
+
+    size_t budget = SIZE_MAX;
+    drain( &budget );
+
+    while ( _anchor.next != &_anchor )
+    {
+        delete_stack( _anchor.next );
+    }
+
+    while ( _free_pieces )
+    {
+        piece* p = _free_pieces;
+        _free_pieces = p->prev;
+        delete p;
+    }
+
+    while ( _free_stacks )
+    {
+        stack* s = _free_stacks;
+        _free_stacks = s->next;
+        delete s;
+    }
+
+    while ( _free_chunks )
+    {
+        chunk* c = _free_chunks;
+        _free_chunks = c->prev;
+        delete c;
+    }
+}
+
+?(user_value)void $(class_name)::reset( const user_value& u )
+!(user_value)void $(class_name)::reset()
+{
+?(syntax_tree)    _tree = syntax_tree();
+?(yield)    $$(yield_queue).clear();
+?(user_value)    start( START_STATE, u );
+!(user_value)    start( START_STATE );
+}
+
+?(user_value)void $(class_name)::parse_as( int entry, const user_value& u )
+!(user_value)void $(class_name)::parse_as( int entry )
+{
+?(yield)    $$(yield_queue).clear();
+?(syntax_tree)    _tree = syntax_tree();
+?(syntax_tree)
+    // Find the start state for the entry symbol.
+    for ( const start_info& info : START_STATES )
+    {
+        if ( info.nterm == entry )
+        {
+?(user_value)            start( info.state, u );
+!(user_value)            start( info.state );
+            return;
+        }
+    }
+
+    assert( ! "not an entry symbol" );
+}
+
+?(user_value)void $(class_name)::start( int state, const user_value& u )
+!(user_value)void $(class_name)::start( int state )
+{
+    // Delete all parse stacks.  Their storage is kept for reuse.
+    size_t budget = SIZE_MAX;
+    drain( &budget );
     while ( _anchor.next != &_anchor )
     {
         delete_stack( _anchor.next );
     }
+
+    // Start again with a single stack in the start state.
+    stack* s = alloc_stack();
+?(user_value)    s->u = u;
+    s->state = state;
+    s->head = alloc_piece( 1, nullptr );
+    s->prev = &_anchor;
+    s->next = &_anchor;
+    _anchor.next = s;
+    _anchor.prev = s;
+?(position)
+?(position)    // Count token positions from the start, outside any lazy region.
+?(position)    _position = 0;
+?(lazy)    _skip = lazy_skip();
+?(stop_after)    _done = false;
+?(error_token)    _recovering = 0;
+?(error_repair)    _repair = repair_state();
+    _step.pending = false;
+?(token_type)    _step.tokval.clear();
+?(lookahead)    _ahead.waiting = false;
+?(lookahead)    _ahead.deciding = false;
+?(lookahead)?(token_type)    _ahead.tokval.clear();
+}
+
+$(class_name)::snapshot $(class_name)::checkpoint()
+{
+    // A token being parsed by parse_step must be finished first.
+    assert( ! _step.pending );
+
+    snapshot snap;
+    snap._parser = this;
+    for ( stack* s = _anchor.next; s != &_anchor; s = s->next )
+    {
+        piece* p = share_head( s );
+?(user_value)        snap._entries.push_back( { s->u, s->state, p } );
+!(user_value)        snap._entries.push_back( { s->state, p } );
+    }
+?(position)    snap._position = _position;
+?(lazy)    snap._skip = _skip;
+?(stop_after)    snap._done = _done;
+?(error_token)    snap._recovering = _recovering;
+?(error_repair)    snap._repair = _repair;
+?(lookahead)    snap._ahead = _ahead;
+    return snap;
 }
 
-?(token_type)void $(class_name)::parse( int token, const token_type& tokval )
-!(token_type)void $(class_name)::parse( int token )
+std::unique_ptr< $(class_name) > $(class_name)::fork()
 {
-    // Evaluate for each active parse stack.
+    // A token being parsed by parse_step must be finished first.
+    assert( ! _step.pending );
+
+    std::unique_ptr< $(class_name) > f( new $(class_name)( fork_tag() ) );
     for ( stack* s = _anchor.next; s != &_anchor; s = s->next )
+    {
+        // Freeze all pieces shared with the fork, as the fork may continue on
+        // another thread.  Pieces below a frozen piece are already frozen.
+        piece* p = share_head( s );
+        for ( piece* q = p; q && ! q->frozen; q = q->prev )
+        {
+            q->frozen = true;
+        }
+
+        // Create matching stack in the fork.
+        stack* fs = f->alloc_stack();
+?(user_value)        fs->u = user_split( s->u );
+        fs->state = s->state;
+        fs->head = f->alloc_piece( 1, p );
+        fs->prev = f->_anchor.prev;
+        fs->next = &f->_anchor;
+        fs->prev->next = fs;
+        fs->next->prev = fs;
+    }
+?(position)    f->_position = _position;
+?(syntax_tree)    f->_tree = _tree;
+?(lazy)    f->_skip = _skip;
+?(stop_after)    f->_done = _done;
+?(error_token)    f->_recovering = _recovering;
+?(error_repair)    f->_repair = _repair;
+?(lookahead)    f->_ahead = _ahead;
+    return f;
+}
+
+?(writer_type)void $(class_name)::serialize( writer_type& w )
+?(writer_type){
+?(writer_type)    // A token being parsed by parse_step must be finished first.
+?(writer_type)    assert( ! _step.pending );
+?(writer_type)
+?(writer_type)    // Identify the parser tables the state belongs to.
+?(writer_type)    write_value( w, STATE_COUNT );
+?(writer_type)    write_value( w, RULE_COUNT );
+?(writer_type)    write_value( w, GRAMMAR_HASH[ 0 ] );
+?(writer_type)    write_value( w, GRAMMAR_HASH[ 1 ] );
+?(writer_type)
+?(writer_type)    // Find pieces, ordered so that each piece follows the piece below it.
+?(writer_type)    std::unordered_map< piece*, size_t > ids;
+?(writer_type)    std::vector< piece* > pieces;
+?(writer_type)    std::vector< piece* > chain;
+?(writer_type)    int stack_count = 0;
+?(writer_type)    for ( stack* s = _anchor.next; s != &_anchor; s = s->next )
+?(writer_type)    {
+?(writer_type)        for ( piece* p = s->head; p && ! ids.count( p ); p = p->prev )
+?(writer_type)        {
+?(writer_type)            chain.push_back( p );
+?(writer_type)        }
+?(writer_type)        while ( chain.size() )
+?(writer_type)        {
+?(writer_type)            ids.emplace( chain.back(), pieces.size() );
+?(writer_type)            pieces.push_back( chain.back() );
+?(writer_type)            chain.pop_back();
+?(writer_type)        }
+?(writer_type)        stack_count += 1;
+?(writer_type)    }
+?(writer_type)
+?(writer_type)    // Write pieces.  Each is one more than the index of the piece below, or
+?(writer_type)    // zero for the bottom piece, then values.
+?(writer_type)    write_size( w, pieces.size() );
+?(writer_type)    std::vector< value* > values;
+?(writer_type)    for ( piece* p : pieces )
+?(writer_type)    {
+?(writer_type)        write_size( w, p->prev ? ids.at( p->prev ) + 1 : 0 );
+?(writer_type)        write_value( w, (int)p->size );
+?(writer_type)
+?(writer_type)        // Write values from the bottom up.
+?(writer_type)        gather_values( p, &values );
+?(writer_type)        for ( auto i = values.rbegin(); i != values.rend(); ++i )
+?(writer_type)        {
+?(writer_type)            const value& v = **i;
+?(writer_type)            write_value( w, v.state() );
+?(writer_type)            write_value( w, v.kind() );
+?(writer_type)            switch ( v.kind() )
+?(writer_type)            {
+?(writer_type)            case $$(ntype_value): write_value( w, v.get< $$(ntype_type) >() ); break;
+?(writer_type)            }
+?(writer_type)        }
+?(writer_type)    }
+?(writer_type)
+?(writer_type)    // Write stacks.
+?(writer_type)    write_value( w, stack_count );
+?(writer_type)    for ( stack* s = _anchor.next; s != &_anchor; s = s->next )
+?(writer_type)    {
+?(writer_type)?(user_value)        write_value( w, s->u );
+?(writer_type)        write_value( w, s->state );
+?(writer_type)        write_size( w, ids.at( s->head ) );
+?(writer_type)    }
+?(writer_type)?(position)
+?(writer_type)?(position)    // Write token position and any lazy region being skipped.
+?(writer_type)?(position)    write_size( w, _position );
+?(writer_type)?(lazy)    write_value( w, _skip.depth );
+?(writer_type)?(lazy)    write_value( w, _skip.open );
+?(writer_type)?(lazy)    write_value( w, _skip.close );
+?(writer_type)?(lazy)    write_value( w, _skip.range.nterm );
+?(writer_type)?(lazy)    write_value( w, _skip.range.state );
+?(writer_type)?(lazy)    write_size( w, _skip.range.lower );
+?(writer_type)?(memoize)    write_value( w, (int)_skip.memo );
+?(writer_type)?(memoize)    write_size( w, _skip.tokens.size() );
+?(writer_type)?(memoize)    for ( size_t i = 0; i < _skip.tokens.size(); ++i )
+?(writer_type)?(memoize)    {
+?(writer_type)?(memoize)        write_value( w, _skip.tokens[ i ] );
+?(writer_type)?(memoize)?(token_type)        write_value( w, _skip.tokvals[ i ] );
+?(writer_type)?(memoize)    }
+?(writer_type)?(stop_after)
+?(writer_type)?(stop_after)    // Write whether the parse has stopped.
+?(writer_type)?(stop_after)    write_value( w, (int)_done );
+?(writer_type)?(error_token)
+?(writer_type)?(error_token)    // Write the number of tokens shifted since the last error.
+?(writer_type)?(error_token)    write_value( w, _recovering );
+?(writer_type)?(error_repair)
+?(writer_type)?(error_repair)    // Write the last repair and any tokens held while choosing a repair.
+?(writer_type)?(error_repair)    write_value( w, (int)_repair.active );
+?(writer_type)?(error_repair)    write_value( w, (int)_repair.fix.kind );
+?(writer_type)?(error_repair)    write_value( w, _repair.fix.token );
+?(writer_type)?(error_repair)    write_size( w, _repair.tokens.size() );
+?(writer_type)?(error_repair)    for ( size_t i = 0; i < _repair.tokens.size(); ++i )
+?(writer_type)?(error_repair)    {
+?(writer_type)?(error_repair)        write_value( w, _repair.tokens[ i ] );
+?(writer_type)?(error_repair)?(token_type)        write_value( w, _repair.tokvals[ i ] );
+?(writer_type)?(error_repair)    }
+?(writer_type)?(lookahead)
+?(writer_type)?(lookahead)    // Write any token waiting for the token after it.
+?(writer_type)?(lookahead)    write_value( w, (int)_ahead.waiting );
+?(writer_type)?(lookahead)    if ( _ahead.waiting )
+?(writer_type)?(lookahead)    {
+?(writer_type)?(lookahead)        write_value( w, _ahead.token );
+?(writer_type)?(lookahead)?(token_type)        write_value( w, _ahead.tokval.front() );
+?(writer_type)?(lookahead)?(position)        write_size( w, _ahead.position );
+?(writer_type)?(lookahead)    }
+?(writer_type)?(syntax_tree)
+?(writer_type)?(syntax_tree)    // Write syntax tree, as stack values are indices of its nodes.
+?(writer_type)?(syntax_tree)    write_size( w, _tree.nodes.size() );
+?(writer_type)?(syntax_tree)    for ( const tree_node& n : _tree.nodes )
+?(writer_type)?(syntax_tree)    {
+?(writer_type)?(syntax_tree)        write_value( w, n.kind );
+?(writer_type)?(syntax_tree)        write_value( w, n.rule );
+?(writer_type)?(syntax_tree)        write_value( w, n.state );
+?(writer_type)?(syntax_tree)        write_value( w, (int)n.lower );
+?(writer_type)?(syntax_tree)        write_value( w, (int)n.upper );
+?(writer_type)?(syntax_tree)        write_value( w, (int)n.first );
+?(writer_type)?(syntax_tree)        write_value( w, (int)n.length );
+?(writer_type)?(syntax_tree)    }
+?(writer_type)?(syntax_tree)    write_size( w, _tree.children.size() );
+?(writer_type)?(syntax_tree)    for ( unsigned child : _tree.children )
+?(writer_type)?(syntax_tree)    {
+?(writer_type)?(syntax_tree)        write_value( w, (int)child );
+?(writer_type)?(syntax_tree)    }
+?(writer_type)}
+?(writer_type)
+?(writer_type)void $(class_name)::write_size( writer_type& w, size_t v )
+?(writer_type){
+?(writer_type)    // Write sizes as two ints, low half first, so that they are not limited
+?(writer_type)    // to the range of an int.
+?(writer_type)    write_value( w, (int)(uint32_t)v );
+?(writer_type)    write_value( w, (int)(uint32_t)( (uint64_t)v >> 32 ) );
+?(writer_type)}
+?(writer_type)
+?(reader_type)bool $(class_name)::deserialize( reader_type& r )
+?(reader_type){
+?(reader_type)    // Check that the state was written by a parser with the same tables.
+?(reader_type)    int state_count = 0;
+?(reader_type)    int rule_count = 0;
+?(reader_type)    int hash[ 2 ] = {};
+?(reader_type)    read_value( r, state_count );
+?(reader_type)    read_value( r, rule_count );
+?(reader_type)    read_value( r, hash[ 0 ] );
+?(reader_type)    read_value( r, hash[ 1 ] );
+?(reader_type)    if ( state_count != STATE_COUNT || rule_count != RULE_COUNT || hash[ 0 ] != GRAMMAR_HASH[ 0 ] || hash[ 1 ] != GRAMMAR_HASH[ 1 ] )
+?(reader_type)    {
+?(reader_type)        return false;
+?(reader_type)    }
+?(reader_type)
+?(reader_type)    // Read the state into a snapshot, which is restored only once the whole
+?(reader_type)    // state has been read.  Pieces are held until then, so that all are
+?(reader_type)    // released if the stream is truncated or corrupt.
+?(reader_type)    struct piece_holder
+?(reader_type)    {
+?(reader_type)        $(class_name)* owner;
+?(reader_type)        std::vector< piece* > pieces;
+?(reader_type)        ~piece_holder()
+?(reader_type)        {
+?(reader_type)            for ( piece* p : pieces )
+?(reader_type)            {
+?(reader_type)                owner->release_piece( p );
+?(reader_type)            }
+?(reader_type)        }
+?(reader_type)    };
+?(reader_type)    snapshot snap;
+?(reader_type)    snap._parser = this;
+?(reader_type)    piece_holder held { this, {} };
+?(reader_type)
+?(reader_type)    // Read pieces.  Each piece is referenced by the pieces above it.
+?(reader_type)    size_t piece_count = 0;
+?(reader_type)    read_size( r, piece_count );
+?(reader_type)    for ( size_t i = 0; i < piece_count; ++i )
+?(reader_type)    {
+?(reader_type)        size_t prev = 0;
+?(reader_type)        int size = 0;
+?(reader_type)        read_size( r, prev );
+?(reader_type)        read_value( r, size );
+?(reader_type)        if ( prev > i )
+?(reader_type)        {
+?(reader_type)            return false;
+?(reader_type)        }
+?(reader_type)
+?(reader_type)        piece* p = alloc_piece( 1, prev ? held.pieces[ prev - 1 ] : nullptr );
+?(reader_type)        if ( p->prev )
+?(reader_type)        {
+?(reader_type)            p->prev->refcount += 1;
+?(reader_type)        }
+?(reader_type)        held.pieces.push_back( p );
+?(reader_type)
+?(reader_type)        for ( int j = 0; j < size; ++j )
+?(reader_type)        {
+?(reader_type)            int state = -1;
+?(reader_type)            int kind = -2;
+?(reader_type)            read_value( r, state );
+?(reader_type)            read_value( r, kind );
+?(reader_type)            switch ( kind )
+?(reader_type)            {
+?(reader_type)            case $$(ntype_value): { $$(ntype_type) v {}; read_value( r, v ); push_value( p, value( state, std::move( v ) ) ); break; }
+?(reader_type)            default: push_value( p, value( state ) ); break;
+?(reader_type)            }
+?(reader_type)        }
+?(reader_type)    }
+?(reader_type)
+?(reader_type)    // Read stacks.
+?(reader_type)    int stack_count = 0;
+?(reader_type)    read_value( r, stack_count );
+?(reader_type)    for ( int i = 0; i < stack_count; ++i )
+?(reader_type)    {
+?(reader_type)        snapshot::entry e {};
+?(reader_type)        size_t head = 0;
+?(reader_type)?(user_value)        read_value( r, e.u );
+?(reader_type)        read_value( r, e.state );
+?(reader_type)        read_size( r, head );
+?(reader_type)        if ( head >= held.pieces.size() )
+?(reader_type)        {
+?(reader_type)            return false;
+?(reader_type)        }
+?(reader_type)        e.head = held.pieces[ head ];
+?(reader_type)        e.head->refcount += 1;
+?(reader_type)        snap._entries.push_back( std::move( e ) );
+?(reader_type)    }
+?(reader_type)?(position)
+?(reader_type)?(position)    // Read token position and any lazy region being skipped.
+?(reader_type)?(position)    read_size( r, snap._position );
+?(reader_type)?(lazy)    read_value( r, snap._skip.depth );
+?(reader_type)?(lazy)    read_value( r, snap._skip.open );
+?(reader_type)?(lazy)    read_value( r, snap._skip.close );
+?(reader_type)?(lazy)    read_value( r, snap._skip.range.nterm );
+?(reader_type)?(lazy)    read_value( r, snap._skip.range.state );
+?(reader_type)?(lazy)    read_size( r, snap._skip.range.lower );
+?(reader_type)?(memoize)
+?(reader_type)?(memoize)    // Read tokens of any memoized region being skipped.
+?(reader_type)?(memoize)    int memo = 0;
+?(reader_type)?(memoize)    size_t token_count = 0;
+?(reader_type)?(memoize)    read_value( r, memo );
+?(reader_type)?(memoize)    read_size( r, token_count );
+?(reader_type)?(memoize)    snap._skip.memo = memo != 0;
+?(reader_type)?(memoize)    for ( size_t i = 0; i < token_count; ++i )
+?(reader_type)?(memoize)    {
+?(reader_type)?(memoize)        int token = 0;
+?(reader_type)?(memoize)?(token_type)        token_type tokval {};
+?(reader_type)?(memoize)        read_value( r, token );
+?(reader_type)?(memoize)?(token_type)        read_value( r, tokval );
+?(reader_type)?(memoize)        snap._skip.tokens.push_back( token );
+?(reader_type)?(memoize)?(token_type)        snap._skip.tokvals.push_back( std::move( tokval ) );
+?(reader_type)?(memoize)    }
+?(reader_type)?(stop_after)
+?(reader_type)?(stop_after)    // Read whether the parse has stopped.
+?(reader_type)?(stop_after)    int done = 0;
+?(reader_type)?(stop_after)    read_value( r, done );
+?(reader_type)?(stop_after)    snap._done = done != 0;
+?(reader_type)?(error_token)
+?(reader_type)?(error_token)    // Read the number of tokens shifted since the last error.
+?(reader_type)?(error_token)    read_value( r, snap._recovering );
+?(reader_type)?(error_repair)
+?(reader_type)?(error_repair)    // Read the last repair and any tokens held while choosing a repair.
+?(reader_type)?(error_repair)    int active = 0;
+?(reader_type)?(error_repair)    int kind = 0;
+?(reader_type)?(error_repair)    size_t held_count = 0;
+?(reader_type)?(error_repair)    read_value( r, active );
+?(reader_type)?(error_repair)    read_value( r, kind );
+?(reader_type)?(error_repair)    read_value( r, snap._repair.fix.token );
+?(reader_type)?(error_repair)    read_size( r, held_count );
+?(reader_type)?(error_repair)    snap._repair.active = active != 0;
+?(reader_type)?(error_repair)    snap._repair.fix.kind = (repair_kind)kind;
+?(reader_type)?(error_repair)    for ( size_t i = 0; i < held_count; ++i )
+?(reader_type)?(error_repair)    {
+?(reader_type)?(error_repair)        int token = 0;
+?(reader_type)?(error_repair)?(token_type)        token_type tokval {};
+?(reader_type)?(error_repair)        read_value( r, token );
+?(reader_type)?(error_repair)?(token_type)        read_value( r, tokval );
+?(reader_type)?(error_repair)        snap._repair.tokens.push_back( token );
+?(reader_type)?(error_repair)?(token_type)        snap._repair.tokvals.push_back( std::move( tokval ) );
+?(reader_type)?(error_repair)    }
+?(reader_type)?(lookahead)
+?(reader_type)?(lookahead)    // Read any token waiting for the token after it.
+?(reader_type)?(lookahead)    int waiting = 0;
+?(reader_type)?(lookahead)    read_value( r, waiting );
+?(reader_type)?(lookahead)    if ( waiting )
+?(reader_type)?(lookahead)    {
+?(reader_type)?(lookahead)?(token_type)        token_type tokval {};
+?(reader_type)?(lookahead)        read_value( r, snap._ahead.token );
+?(reader_type)?(lookahead)?(token_type)        read_value( r, tokval );
+?(reader_type)?(lookahead)?(position)        read_size( r, snap._ahead.position );
+?(reader_type)?(lookahead)        snap._ahead.waiting = true;
+?(reader_type)?(lookahead)?(token_type)        snap._ahead.tokval.push_back( std::move( tokval ) );
+?(reader_type)?(lookahead)    }
+?(reader_type)?(syntax_tree)
+?(reader_type)?(syntax_tree)    // Read syntax tree.
+?(reader_type)?(syntax_tree)    syntax_tree tree;
+?(reader_type)?(syntax_tree)    size_t node_count = 0;
+?(reader_type)?(syntax_tree)    read_size( r, node_count );
+?(reader_type)?(syntax_tree)    for ( size_t i = 0; i < node_count; ++i )
+?(reader_type)?(syntax_tree)    {
+?(reader_type)?(syntax_tree)        int n[ 7 ] = {};
+?(reader_type)?(syntax_tree)        for ( int j = 0; j < 7; ++j )
+?(reader_type)?(syntax_tree)        {
+?(reader_type)?(syntax_tree)            read_value( r, n[ j ] );
+?(reader_type)?(syntax_tree)        }
+?(reader_type)?(syntax_tree)        tree.nodes.push_back( { n[ 0 ], n[ 1 ], n[ 2 ], (unsigned)n[ 3 ], (unsigned)n[ 4 ], (unsigned)n[ 5 ], (unsigned)n[ 6 ] } );
+?(reader_type)?(syntax_tree)    }
+?(reader_type)?(syntax_tree)    size_t child_count = 0;
+?(reader_type)?(syntax_tree)    read_size( r, child_count );
+?(reader_type)?(syntax_tree)    for ( size_t i = 0; i < child_count; ++i )
+?(reader_type)?(syntax_tree)    {
+?(reader_type)?(syntax_tree)        int child = 0;
+?(reader_type)?(syntax_tree)        read_value( r, child );
+?(reader_type)?(syntax_tree)        tree.children.push_back( (unsigned)child );
+?(reader_type)?(syntax_tree)    }
+?(reader_type)
+?(reader_type)    // Replace the parser's stacks with those read, which take over the
+?(reader_type)    // references held by the snapshot.
+?(reader_type)    while ( _anchor.next != &_anchor )
+?(reader_type)    {
+?(reader_type)        delete_stack( _anchor.next );
+?(reader_type)    }
+?(reader_type)    for ( snapshot::entry& e : snap._entries )
+?(reader_type)    {
+?(reader_type)        stack* s = alloc_stack();
+?(reader_type)?(user_value)        s->u = std::move( e.u );
+?(reader_type)        s->state = e.state;
+?(reader_type)        s->head = e.head;
+?(reader_type)        s->prev = _anchor.prev;
+?(reader_type)        s->next = &_anchor;
+?(reader_type)        s->prev->next = s;
+?(reader_type)        s->next->prev = s;
+?(reader_type)    }
+?(reader_type)    snap._entries.clear();
+?(reader_type)    restore_fields( snap );
+?(reader_type)?(syntax_tree)    _tree = std::move( tree );
+?(reader_type)    return true;
+?(reader_type)}
+?(reader_type)
+?(reader_type)void $(class_name)::read_size( reader_type& r, size_t& v )
+?(reader_type){
+?(reader_type)    // Sizes are written as two ints, low half first.
+?(reader_type)    int low = 0;
+?(reader_type)    int high = 0;
+?(reader_type)    read_value( r, low );
+?(reader_type)    read_value( r, high );
+?(reader_type)    v = (size_t)( (uint64_t)(uint32_t)high << 32 | (uint32_t)low );
+?(reader_type)}
+?(reader_type)
+void $(class_name)::restore( const snapshot& snap )
+{
+    assert( snap._parser == this );
+
+    // Delete all parse stacks.
+    while ( _anchor.next != &_anchor )
+    {
+        delete_stack( _anchor.next );
+    }
+
+    // Recreate each stack in the snapshot, sharing its pieces.
+    for ( const snapshot::entry& e : snap._entries )
+    {
+        if ( e.head )
+        {
+            e.head->refcount += 1;
+        }
+
+        stack* s = alloc_stack();
+?(user_value)        s->u = e.u;
+        s->state = e.state;
+        s->head = alloc_piece( 1, e.head );
+        s->prev = _anchor.prev;
+        s->next = &_anchor;
+        s->prev->next = s;
+        s->next->prev = s;
+    }
+    restore_fields( snap );
+}
+
+void $(class_name)::restore_fields( const snapshot& snap )
+{
+?(position)    _position = snap._position;
+?(lazy)    _skip = snap._skip;
+?(stop_after)    _done = snap._done;
+?(error_token)    _recovering = snap._recovering;
+?(error_repair)    _repair = snap._repair;
+    _step.pending = false;
+?(token_type)    _step.tokval.clear();
+?(lookahead)    _ahead = snap._ahead;
+?(yield)
+?(yield)    // Values queued after the snapshot was taken belong to the abandoned parse.
+?(yield)    $$(yield_queue).clear();
+}
+
+?(token_type)bool $(class_name)::parse( int token, const token_type& tokval )
+!(token_type)bool $(class_name)::parse( int token )
+{
+    assert( ! _step.pending );
+    size_t budget = SIZE_MAX;
+?(token_type)    return parse_token( token, tokval, &budget ) == STEP_STOPPED;
+!(token_type)    return parse_token( token, &budget ) == STEP_STOPPED;
+}
+
+?(token_type)$(class_name)::step_result $(class_name)::parse_step( int token, const token_type& tokval, size_t budget )
+!(token_type)$(class_name)::step_result $(class_name)::parse_step( int token, size_t budget )
+{
+    assert( ! _step.pending );
+    assert( budget > 0 );
+    drain( &budget );
+
+    // Stacks deleted while stepping release their pieces in later calls.
+    _step.defer = true;
+?(token_type)    step_result result = parse_token( token, tokval, &budget );
+!(token_type)    step_result result = parse_token( token, &budget );
+    _step.defer = false;
+
+    // Keep the token until the parse catches up with it.
+    if ( result == STEP_MORE )
+    {
+        _step.pending = true;
+        _step.token = token;
+?(token_type)        _step.tokval.push_back( tokval );
+    }
+    return result;
+}
+
+$(class_name)::step_result $(class_name)::parse_step( size_t budget )
+{
+    assert( budget > 0 );
+    drain( &budget );
+    if ( ! _step.pending )
+    {
+        return STEP_DONE;
+    }
+
+    _step.defer = true;
+?(lookahead)    if ( _ahead.deciding )
+?(lookahead)    {
+?(lookahead)        // Finish the held token, then parse the token which decided it.
+?(lookahead)        step_result result = finish_ahead( _step.s, &budget );
+?(lookahead)        if ( result == STEP_DONE )
+?(lookahead)        {
+?(lookahead)?(token_type)            result = parse_token( _step.token, _step.tokval.front(), &budget );
+?(lookahead)!(token_type)            result = parse_token( _step.token, &budget );
+?(lookahead)        }
+?(lookahead)        _step.defer = false;
+?(lookahead)
+?(lookahead)        if ( result != STEP_MORE )
+?(lookahead)        {
+?(lookahead)            _step.pending = false;
+?(lookahead)?(token_type)            _step.tokval.clear();
+?(lookahead)        }
+?(lookahead)        return result;
+?(lookahead)    }
+?(lookahead)
+?(token_type)?(position)    step_result result = parse_stacks( _step.s, _step.token, _step.tokval.front(), _step.position, &budget );
+?(token_type)!(position)    step_result result = parse_stacks( _step.s, _step.token, _step.tokval.front(), &budget );
+!(token_type)?(position)    step_result result = parse_stacks( _step.s, _step.token, _step.position, &budget );
+!(token_type)!(position)    step_result result = parse_stacks( _step.s, _step.token, &budget );
+    _step.defer = false;
+
+    if ( result != STEP_MORE )
+    {
+        _step.pending = false;
+?(token_type)        _step.tokval.clear();
+    }
+    return result;
+}
+
+?(token_type)$(class_name)::step_result $(class_name)::parse_token( int token, const token_type& tokval, size_t* budget )
+!(token_type)$(class_name)::step_result $(class_name)::parse_token( int token, size_t* budget )
+{
+?(stop_after)    // Once parsing has stopped, ignore tokens until the parser is reset.
+?(stop_after)    if ( _done )
+?(stop_after)    {
+?(stop_after)        return STEP_STOPPED;
+?(stop_after)    }
+?(stop_after)
+?(lookahead)    // This token decides the conflict on a token which is waiting for it.
+?(lookahead)    // If the budget runs out first, parse_step parses this token later.
+?(lookahead)    if ( _ahead.waiting )
+?(lookahead)    {
+?(lookahead)        step_result result = resume_ahead( token, budget );
+?(lookahead)        if ( result != STEP_DONE )
+?(lookahead)        {
+?(lookahead)            return result;
+?(lookahead)        }
+?(lookahead)    }
+?(lookahead)
+?(error_repair)    // While choosing a repair, hold tokens until the window is full.
+?(error_repair)    if ( _repair.active )
+?(error_repair)    {
+?(error_repair)        _repair.tokens.push_back( token );
+?(error_repair)?(token_type)        _repair.tokvals.push_back( tokval );
+?(error_repair)        if ( _repair.tokens.size() > (size_t)REPAIR_WINDOW || token == 0 )
+?(error_repair)        {
+?(error_repair)            return finish_repair();
+?(error_repair)        }
+?(error_repair)        return STEP_DONE;
+?(error_repair)    }
+?(error_repair)
+?(position)    // Count tokens, so that lazy regions can be parsed later and so that
+?(position)    // events can report token positions.
+?(position)    size_t position = _position++;
+?(position)
+?(lazy)    // Inside a lazy region, only track nesting of the delimiters.
+?(lazy)    if ( _skip.depth )
+?(lazy)    {
+?(memoize)?(token_type)        remember( token, tokval );
+?(memoize)!(token_type)        remember( token );
+?(lazy)        if ( token == _skip.close )
+?(lazy)        {
+?(lazy)            if ( --_skip.depth == 0 )
+?(lazy)            {
+?(lazy)                close_lazy( position );
+?(lazy)            }
+?(lazy)        }
+?(lazy)        else if ( token == _skip.open )
+?(lazy)        {
+?(lazy)            _skip.depth += 1;
+?(lazy)        }
+?(lazy)        else if ( token == 0 )
+?(lazy)        {
+?(lazy)            // The region is never closed.
+?(lazy)            _skip.depth = 0;
+?(lazy)?(user_value)?(token_type)            error( _anchor.next->u, token, tokval );
+?(lazy)?(user_value)!(token_type)            error( _anchor.next->u, token );
+?(lazy)!(user_value)?(token_type)            error( token, tokval );
+?(lazy)!(user_value)!(token_type)            error( token );
+?(lazy)        }
+?(lazy)        return STEP_DONE;
+?(lazy)    }
+?(lazy)
+?(token_type)?(position)    return parse_stacks( _anchor.next, token, tokval, position, budget );
+?(token_type)!(position)    return parse_stacks( _anchor.next, token, tokval, budget );
+!(token_type)?(position)    return parse_stacks( _anchor.next, token, position, budget );
+!(token_type)!(position)    return parse_stacks( _anchor.next, token, budget );
+}
+
+?(token_type)?(position)$(class_name)::step_result $(class_name)::parse_stacks( stack* first, int token, const token_type& tokval, size_t position, size_t* budget )
+?(token_type)!(position)$(class_name)::step_result $(class_name)::parse_stacks( stack* first, int token, const token_type& tokval, size_t* budget )
+!(token_type)?(position)$(class_name)::step_result $(class_name)::parse_stacks( stack* first, int token, size_t position, size_t* budget )
+!(token_type)!(position)$(class_name)::step_result $(class_name)::parse_stacks( stack* first, int token, size_t* budget )
+{
+    // Evaluate for each active parse stack, starting from the first stack
+    // which has not yet shifted the token.
+    for ( stack* s = first; s != &_anchor; s = s->next )
     {
         // Loop until this parse fails or we manage to shift the token.
         while ( true )
         {
             assert( s != &_anchor );
 
+            // Pause between actions once the budget is spent.
+            if ( *budget == 0 )
+            {
+                _step.s = s;
+?(position)                _step.position = position;
+                return STEP_MORE;
+            }
+            *budget -= 1;
+?(stop_after)
+?(stop_after)            // Stop without consuming the token once a target is reduced.
+?(stop_after)            if ( _done )
+?(stop_after)            {
+?(stop_after)                return STEP_STOPPED;
+?(stop_after)            }
+
             // Look up action.
             int action = lookup_action( s->state, token );
+            if ( _speculation && underflows( s, action ) )
+            {
+                // This speculative stack needs values from before its start.
+                block( ( s = s->prev )->next );
+                break;
+            }
+?(lookahead)
+?(lookahead)            // Where the next token decides a conflict, use it.  If there is
+?(lookahead)            // only one stack, wait for the next token rather than splitting.
+?(lookahead)            if ( action >= STATE_COUNT + RULE_COUNT && action < STATE_COUNT + RULE_COUNT + CONFLICT_COUNT )
+?(lookahead)            {
+?(lookahead)                if ( _ahead.deciding )
+?(lookahead)                {
+?(lookahead)                    action = lookahead_action( s->state, token, _ahead.next, action );
+?(lookahead)                }
+?(lookahead)                else if ( s->next == &_anchor && s->prev == &_anchor && ! _speculation && lookahead_waits( s->state, token ) )
+?(lookahead)                {
+?(lookahead)                    _ahead.waiting = true;
+?(lookahead)                    _ahead.token = token;
+?(lookahead)?(token_type)                    _ahead.tokval.push_back( tokval );
+?(lookahead)?(position)                    _ahead.position = position;
+?(lookahead)                    return STEP_DONE;
+?(lookahead)                }
+?(lookahead)            }
+?(predicates)
+?(predicates)            // Discard alternatives of a conflict whose predicates fail.
+?(predicates)            const unsigned short* conflict = nullptr;
+?(predicates)            if ( action >= STATE_COUNT + RULE_COUNT && action < STATE_COUNT + RULE_COUNT + CONFLICT_COUNT )
+?(predicates)            {
+?(predicates)?(token_type)                action = filter_conflict( s, action, token, tokval, &conflict );
+?(predicates)!(token_type)                action = filter_conflict( s, action, token, &conflict );
+?(predicates)            }
+
             if ( action < STATE_COUNT )
             {
+?(lazy)                // If this is the only stack, skip lazy regions.
+?(lazy)                if ( s->next == &_anchor && s->prev == &_anchor && ! _speculation && open_lazy( s, token, position ) )
+?(lazy)                {
+?(memoize)?(token_type)                    remember( token, tokval );
+?(memoize)!(token_type)                    remember( token );
+?(lazy)                    break;
+?(lazy)                }
+?(lazy)
                 // Shift and move to the state encoded in the action.
 #ifdef POMELO_TRACE
                 printf( "SHIFT %s\n", symbol_name( token ) );
                 dump_stack( s );
 #endif
                 
-?(token_type)                s->head->values.push_back( value( s->state, token_type( tokval ) ) );
-!(token_type)                s->head->values.push_back( value( s->state, std::nullptr_t() ) );
+?(events)?(user_value)?(token_type)                on_shift( s->u, token, tokval );
+?(events)?(user_value)!(token_type)                on_shift( s->u, token );
+?(events)!(user_value)?(token_type)                on_shift( token, tokval );
+?(events)!(user_value)!(token_type)                on_shift( token );
+?(events)                push_value( s->head, value( s->state, size_t( position ) ) );
+?(syntax_tree)                push_value( s->head, value( s->state, tree_token( s->state, token, position ) ) );
+?(actions)?(token_type)                push_value( s->head, value( s->state, token_type( tokval ) ) );
+?(actions)!(token_type)                push_value( s->head, value( s->state, std::nullptr_t() ) );
                 s->state = action;
 
 #ifdef POMELO_TRACE
@@ -264,7 +1166,7 @@ $(class_name)::~$(class_name)()
                 stack* z = s->prev;
                 
                 // Get list of actions in the conflict.
-                const unsigned short* conflict = CONFLICT + action - STATE_COUNT - RULE_COUNT;
+!(predicates)                const unsigned short* conflict = CONFLICT + action - STATE_COUNT - RULE_COUNT;
                 int conflict_count = conflict[ 0 ];
                 assert( conflict_count >= 2 );
                 
@@ -282,8 +1184,14 @@ $(class_name)::~$(class_name)()
                     
                     // Shift and move to the state encoded in the action.
                     int action = conflict[ conflict_index++ ];
-?(token_type)                    z->head->values.push_back( value( z->state, token_type( tokval ) ) );
-!(token_type)                    z->head->values.push_back( value( z->state, std::nullptr_t() ) );
+?(events)?(user_value)?(token_type)                    on_shift( z->u, token, tokval );
+?(events)?(user_value)!(token_type)                    on_shift( z->u, token );
+?(events)!(user_value)?(token_type)                    on_shift( token, tokval );
+?(events)!(user_value)!(token_type)                    on_shift( token );
+?(events)                    push_value( z->head, value( z->state, size_t( position ) ) );
+?(syntax_tree)                    push_value( z->head, value( z->state, tree_token( z->state, token, position ) ) );
+?(actions)?(token_type)                    push_value( z->head, value( z->state, token_type( tokval ) ) );
+?(actions)!(token_type)                    push_value( z->head, value( z->state, std::nullptr_t() ) );
                     z->state = action;
 
 #ifdef POMELO_TRACE
@@ -313,7 +1221,7 @@ $(class_name)::~$(class_name)()
                         assert( z->head->refcount > 0 );
                         if ( z->head->refcount > 1 )
                         {
-                            z->head = new piece { 1, z->head };
+                            z->head = alloc_piece( 1, z->head );
                         }
                     }
 
@@ -345,8 +1253,9 @@ $(class_name)::~$(class_name)()
             }
             else if ( action == ERROR_ACTION )
             {
-                // If this is not the only stack, then destroy the stack.
-                if ( s->next != &_anchor || s->prev != &_anchor )
+                // If this is not the only stack, or this is a speculative
+                // parse, then destroy the stack.
+                if ( s->next != &_anchor || s->prev != &_anchor || _speculation )
                 {
 #ifdef POMELO_TRACE
                     printf( "--DELETE %p--\n", s );
@@ -363,23 +1272,221 @@ $(class_name)::~$(class_name)()
                     break;
                 }
                 
-                // Otherwise report the error.
-?(user_value)?(token_type)                error( s->u, token, tokval );
-?(user_value)!(token_type)                error( s->u, token );
-!(user_value)?(token_type)                error( token, tokval );
-!(user_value)!(token_type)                error( token );
-                
-                // TODO: error recovery.
-                return;
+?(error_repair)                // Hold this token, and the tokens which follow it, until
+?(error_repair)                // there are enough to choose a repair.
+?(error_repair)?(error_token)                if ( ! _repair.skip && _recovering == 0 )
+?(error_repair)!(error_token)                if ( ! _repair.skip )
+?(error_repair)                {
+?(error_repair)                    _repair.active = true;
+?(error_repair)                    _repair.tokens.push_back( token );
+?(error_repair)?(token_type)                    _repair.tokvals.push_back( tokval );
+?(error_repair)                    if ( REPAIR_WINDOW == 0 || token == 0 )
+?(error_repair)                    {
+?(error_repair)                        return finish_repair();
+?(error_repair)                    }
+?(error_repair)                    return STEP_DONE;
+?(error_repair)                }
+?(error_repair)                _repair.skip = false;
+?(error_repair)
+                // Otherwise report the error, unless still recovering from
+                // an earlier error.
+?(error_token)                if ( _recovering == 0 )
+?(error_token)                {
+?(error_token)?(user_value)?(token_type)                    error( s->u, token, tokval );
+?(error_token)?(user_value)!(token_type)                    error( s->u, token );
+?(error_token)!(user_value)?(token_type)                    error( token, tokval );
+?(error_token)!(user_value)!(token_type)                    error( token );
+?(error_token)                }
+?(error_token)
+?(error_token)                // Once the error symbol has been shifted, discard tokens
+?(error_token)                // until one can follow it.
+?(error_token)                if ( _recovering == 3 )
+?(error_token)                {
+?(error_token)                    // The end of input cannot be discarded, so report it and
+?(error_token)                    // abandon the parse.
+?(error_token)                    if ( token == 0 )
+?(error_token)                    {
+?(error_token)?(user_value)?(token_type)                        error( s->u, token, tokval );
+?(error_token)?(user_value)!(token_type)                        error( s->u, token );
+?(error_token)!(user_value)?(token_type)                        error( token, tokval );
+?(error_token)!(user_value)!(token_type)                        error( token );
+?(error_token)                        delete_stack( ( s = s->prev )->next );
+?(error_token)                        _recovering = 0;
+?(error_token)                        break;
+?(error_token)                    }
+?(error_token)                    return STEP_DONE;
+?(error_token)                }
+?(error_token)
+?(error_token)                // Pop the stack back to a state which can shift the error
+?(error_token)                // symbol, shift it, and try the token again.
+?(error_token)                _recovering = 3;
+?(error_token)?(position)                recover( s, position );
+?(error_token)!(position)                recover( s );
+?(error_token)                continue;
+!(error_token)?(user_value)?(token_type)                error( s->u, token, tokval );
+!(error_token)?(user_value)!(token_type)                error( s->u, token );
+!(error_token)!(user_value)?(token_type)                error( token, tokval );
+!(error_token)!(user_value)!(token_type)                error( token );
+!(error_token)
+!(error_token)                // Without error rules, the token is discarded.
+!(error_token)                return STEP_DONE;
             }
             else if ( action == ACCEPT_ACTION )
             {
-                // Everything is fine, clean up by destroying the stack.
-                delete_stack( ( s = s->prev )->next );
-                break;
+?(parse_accept)                // Pass the result to the accept function and start again.
+?(parse_accept)                accept( s );
+?(parse_accept)                return STEP_DONE;
+!(parse_accept)                // Pass the result to any accept function, then clean up by
+!(parse_accept)                // destroying the stack.
+!(parse_accept)                accept( s );
+!(parse_accept)                delete_stack( ( s = s->prev )->next );
+!(parse_accept)                break;
             }
         }
     }
+
+?(error_token)    // Errors are reported again once three tokens have been shifted.
+?(error_token)    if ( _recovering )
+?(error_token)    {
+?(error_token)        _recovering -= 1;
+?(error_token)    }
+?(error_token)
+    return STEP_DONE;
+}
+
+?(lexer)bool $(class_name)::parse_all( lexer_type& lexer )
+?(lexer){
+?(lexer)?(token_type)    token_type tokval;
+?(lexer)    while ( true )
+?(lexer)    {
+?(lexer)        // The lexer is told the state when there is only one parse, so it
+?(lexer)        // can decide between tokens that depend on context.
+?(lexer)        int state = -1;
+?(lexer)        stack* s = _anchor.next;
+?(lexer)?(lookahead)        if ( s != &_anchor && s->next == &_anchor && ! _ahead.waiting )
+?(lexer)!(lookahead)        if ( s != &_anchor && s->next == &_anchor )
+?(lexer)        {
+?(lexer)            state = s->state;
+?(lexer)        }
+?(lexer)
+?(lexer)?(token_type)        int token = lexer.next( state, tokval );
+?(lexer)?(token_type)        bool done = parse( token, tokval );
+?(lexer)!(token_type)        int token = lexer.next( state );
+?(lexer)!(token_type)        bool done = parse( token );
+?(lexer)        if ( done || token == 0 )
+?(lexer)        {
+?(lexer)            return done;
+?(lexer)        }
+?(lexer)    }
+?(lexer)}
+?(lexer)
+?(scanner)size_t $(class_name)::parse_text( const char* text, size_t length )
+?(scanner){
+?(scanner)    size_t offset = 0;
+?(scanner)    while ( offset < length )
+?(scanner)    {
+?(scanner)        size_t match = 0;
+?(scanner)        int token = scan( text + offset, length - offset, &match );
+?(scanner)        if ( token == -1 )
+?(scanner)        {
+?(scanner)            // No pattern matches the text at this offset.
+?(scanner)            return offset;
+?(scanner)        }
+?(scanner)
+?(scanner)        size_t lower = offset;
+?(scanner)        offset += match;
+?(scanner)        if ( token == -2 )
+?(scanner)        {
+?(scanner)            continue;
+?(scanner)        }
+?(scanner)
+?(scanner)?(token_type)        if ( parse( token, token_type{ std::string_view( text + lower, match ) } ) )
+?(scanner)!(token_type)        if ( parse( token ) )
+?(scanner)        {
+?(scanner)            return offset;
+?(scanner)        }
+?(scanner)    }
+?(scanner)
+?(scanner)?(token_type)    parse( 0, token_type{ std::string_view( text + length, 0 ) } );
+?(scanner)!(token_type)    parse( 0 );
+?(scanner)    return length;
+?(scanner)}
+?(scanner)
+?(scanner)int $(class_name)::scan( const char* text, size_t length, size_t* match )
+?(scanner){
+?(scanner)    // Run the DFA until it reaches the dead state, remembering the longest
+?(scanner)    // match.  Skipped text is returned as -2.
+?(scanner)    int token = -1;
+?(scanner)    int state = 0;
+?(scanner)    *match = 0;
+?(scanner)    for ( size_t i = 0; i < length; ++i )
+?(scanner)    {
+?(scanner)        state = SCAN_NEXT[ state * SCAN_CLASS_COUNT + SCAN_CLASS[ (unsigned char)text[ i ] ] ];
+?(scanner)        if ( state == SCAN_STATE_COUNT )
+?(scanner)        {
+?(scanner)            break;
+?(scanner)        }
+?(scanner)
+?(scanner)        int accept = SCAN_ACCEPT[ state ];
+?(scanner)        if ( accept != TOKEN_COUNT + 1 )
+?(scanner)        {
+?(scanner)            token = accept != TOKEN_COUNT ? accept : -2;
+?(scanner)            *match = i + 1;
+?(scanner)        }
+?(scanner)    }
+?(scanner)    return token;
+?(scanner)}
+?(scanner)
+bool $(class_name)::expects( int state, int token )
+{
+    return ( EXPECTED_TOKENS[ state * TOKEN_WORDS + token / 16 ] >> ( token % 16 ) ) & 1;
+}
+
+void $(class_name)::expected_tokens( token_set& expected )
+{
+    for ( int i = 0; i < TOKEN_WORDS; ++i )
+    {
+        expected.words[ i ] = 0;
+    }
+
+?(lazy)    // Inside a lazy region, every token is skipped.
+?(lazy)    if ( _skip.depth )
+?(lazy)    {
+?(lazy)        for ( int token = 0; token < TOKEN_COUNT; ++token )
+?(lazy)        {
+?(lazy)            expected.words[ token / 16 ] |= 1 << ( token % 16 );
+?(lazy)        }
+?(lazy)        return;
+?(lazy)    }
+?(lazy)
+?(lookahead)    // A token waiting for the next token has not been parsed yet, so check
+?(lookahead)    // which tokens can follow it by simulating the parse of both tokens.
+?(lookahead)    if ( _ahead.waiting )
+?(lookahead)    {
+?(lookahead)        stack* s = _anchor.next;
+?(lookahead)        std::vector< int > sim;
+?(lookahead)        for ( int token = 0; token < TOKEN_COUNT; ++token )
+?(lookahead)        {
+?(lookahead)            int tokens[ 2 ] = { _ahead.token, token };
+?(lookahead)            size_t budget = SIZE_MAX;
+?(lookahead)            sim.clear();
+?(lookahead)            if ( simulate( s, &sim, 0, s->state, tokens, 2, &budget ) )
+?(lookahead)            {
+?(lookahead)                expected.words[ token / 16 ] |= 1 << ( token % 16 );
+?(lookahead)            }
+?(lookahead)        }
+?(lookahead)        return;
+?(lookahead)    }
+?(lookahead)
+    // Combine the tokens expected by each parse.
+    for ( stack* s = _anchor.next; s != &_anchor; s = s->next )
+    {
+        const unsigned short* words = EXPECTED_TOKENS + s->state * TOKEN_WORDS;
+        for ( int i = 0; i < TOKEN_WORDS; ++i )
+        {
+            expected.words[ i ] |= words[ i ];
+        }
+    }
 }
 
 
@@ -390,6 +1497,11 @@ int $(class_name)::lookup_action( int state, int token )
     {
         return ACTION_VALUE_TABLE[ index ];
     }
+?(fallback)    else if ( FALLBACK[ token ] != token )
+?(fallback)    {
+?(fallback)        // Retry with the token this one falls back to.
+?(fallback)        return lookup_action( state, FALLBACK[ token ] );
+?(fallback)    }
     else
     {
         return ERROR_ACTION;
@@ -414,24 +1526,38 @@ void $(class_name)::reduce( stack* s, int token, int rule )
     // Perform reduction.
     const rule_info& rinfo = RULE[ rule ];
     reduce_rule( s, rule, rinfo );
+?(stop_after)
+?(stop_after)    // Stop if a target nonterminal was reduced on the only stack.
+?(stop_after)    _done = _done || ( rinfo.stops && s->prev == &_anchor && s->next == &_anchor );
+?(yield)
+?(yield)    // Values reduced on the only stack are passed to the consumer.
+?(yield)    if ( rinfo.yields && s->prev == &_anchor && s->next == &_anchor && ! _speculation )
+?(yield)    {
+?(yield)        yield( rinfo.nterm, piece_value( s->head, s->head->size - 1 ) );
+?(yield)    }
 
     // Unless this reduction could merge stacks, return.
-    if ( ! rinfo.merges || s->head->values.size() != 1 || s->next == &_anchor )
+    if ( ! ( rinfo.merges || rinfo.dprec ) || s->head->size != 1 || ! s->head->prev || s->next == &_anchor )
     {
         return;
     }
 
     // Check other stacks for a reduction to this same nonterminal.  Stacks
     // earlier in the list will already have been reduced.
-    for ( stack* z = s->next; z != &_anchor; z = z->next )
+    stack* znext = nullptr;
+    for ( stack* z = s->next; z != &_anchor; z = znext )
     {
+        // Merging deletes z, so remember the next stack.
+        znext = z->next;
+
         // Track fake state for this parse stack as we 'reduce' it.
         int state = z->state;
         piece* head = z->head;
-        size_t size = z->head->values.size();
+        size_t size = z->head->size;
 
         // Simulate reductions until we hit a mergeable state.
         bool merge = false;
+        int zrule = -1;
         while ( true )
         {
             int action = lookup_action( state, token );
@@ -443,28 +1569,35 @@ void $(class_name)::reduce( stack* s, int token, int rule )
             }
 
             // Simulate reduction.
-            int zrule = action - STATE_COUNT;
+            zrule = action - STATE_COUNT;
             const rule_info& zrinfo = RULE[ zrule ];
 
             // Pop symbols off 'stack'.
             size_t length = zrinfo.length;
             if ( length > 0 )
             {
-                while ( length > 0 )
+                while ( length > 0 && head )
                 {
                     if ( size == 0 )
                     {
                         head = head->prev;
-                        size = z->head->values.size();
+                        size = head ? head->size : 0;
+                        continue;
                     }
                     size_t count = std::min( size, length );
                     size -= count;
                     length -= count;
                 }
 
+                // A speculative stack may not have enough values.
+                if ( ! head )
+                {
+                    break;
+                }
+
                 // This will be wrong if the grammar contains any rules
                 // which entirely composed of erasable rules.
-                state = head->values.at( size ).state();
+                state = piece_value( head, size ).state();
             }
 
             // Move to state.
@@ -492,6 +1625,26 @@ void $(class_name)::reduce( stack* s, int token, int rule )
             continue;
         }
 
+        // Rules with different priorities decide between the parses, and
+        // otherwise the nonterminal's merge function combines them.
+        unsigned zdprec = RULE[ zrule ].dprec;
+        bool prefer = rinfo.dprec && zdprec && rinfo.dprec != zdprec;
+        if ( ! prefer && ! rinfo.merges )
+        {
+            continue;
+        }
+
+        // If this stack has the higher priority, discard the other parse
+        // without performing its reductions.
+        if ( prefer && rinfo.dprec > zdprec )
+        {
+#ifdef POMELO_TRACE
+            printf( "====> DISCARD %p\n", z );
+#endif
+            delete_stack( z );
+            continue;
+        }
+
 #ifdef POMELO_TRACE
         printf( "====> MERGE\n" );
         dump_stacks();
@@ -511,7 +1664,7 @@ void $(class_name)::reduce( stack* s, int token, int rule )
 
             // Check for arrival at mergable state.
             if ( state == s->state && zrinfo.nterm == rinfo.nterm
-                    && z->head->values.size() == 1 && z->head->prev == s->head->prev )
+                    && z->head->size == 1 && z->head->prev == s->head->prev )
             {
                 break;
             }
@@ -519,29 +1672,43 @@ void $(class_name)::reduce( stack* s, int token, int rule )
 
         // Double check that I'm not crazy.
         assert( s->head->prev == z->head->prev );
-        assert( s->head->values.size() == 1 );
-        assert( z->head->values.size() == 1 );
+        assert( s->head->size == 1 );
+        assert( z->head->size == 1 );
 
 #ifdef POMELO_TRACE
         dump_stacks();
 #endif
 
-        // Perform merge.
-        value& a = s->head->values[ 0 ]; (void)a;
-        value& b = z->head->values[ 0 ]; (void)b;
-        switch ( rinfo.nterm )
+        // Perform merge, or keep the other parse if it has higher priority.
+        value& a = piece_value( s->head, 0 ); (void)a;
+        value& b = piece_value( z->head, 0 ); (void)b;
+        if ( prefer )
+        {
+            a = std::move( b );
+?(user_value)            s->u = std::move( z->u );
+        }
+        else
         {
-        case $$(merge_index): a = value( a.state(), $$(merge_name)( s->u, a.move< $$(merge_type) >(), std::move( z->u ), b.move< $$(merge_type) >() ) ); break;
+            switch ( rinfo.nterm )
+            {
+            case $$(merge_index): a = value( a.state(), $$(merge_name)( s->u, a.move< $$(merge_type) >(), std::move( z->u ), b.move< $$(merge_type) >() ) ); break;
+            }
         }
 
         // Delete stack.
-        z->head->values.erase( z->head->values.begin() );
         delete_stack( z );
 
 #ifdef POMELO_TRACE
         dump_stacks();
 #endif
     }
+?(stop_after)
+?(stop_after)    // Merging may have left this as the only stack.
+?(stop_after)    _done = _done || ( rinfo.stops && s->prev == &_anchor && s->next == &_anchor );
+?(yield)    if ( rinfo.yields && s->prev == &_anchor && s->next == &_anchor && ! _speculation )
+?(yield)    {
+?(yield)        yield( rinfo.nterm, piece_value( s->head, s->head->size - 1 ) );
+?(yield)    }
 }
 
 void $(class_name)::reduce_rule( stack* s, int rule, const rule_info& rinfo )
@@ -552,17 +1719,81 @@ void $(class_name)::reduce_rule( stack* s, int rule, const rule_info& rinfo )
 
     // Find length of rule and ensure this stack has at least that many values.
     size_t length = rinfo.length;
+    pull_values( s, length );
+
+#ifdef POMELO_TRACE
+    dump_stack( s );
+#endif
+
+    // An epsilon reduction pushes a new value to hold the result.
+    if ( length == 0 )
+    {
+        push_value( s->head, value( s->state ) );
+    }
+
+    // Get pointer to values used to reduce.
+    value* p = top_values( s->head, std::max( length, (size_t)1 ) );
+
+    // Perform rule.
+?(actions)    switch ( rule )
+?(actions)    {
+?(actions)    case $$(rule_index): p[ 0 ] = value( p[ 0 ].state(), $$(rule_name)($$(rule_args)) ); break;
+?(actions)    }
+?(events)    // The rule spans from its first token up to the lookahead token.
+?(events)    size_t lookahead = _position - 1;
+?(events)    size_t first = length ? p[ 0 ].get< size_t >() : lookahead;
+?(events)?(user_value)    on_reduce( s->u, rule, first, lookahead - first );
+?(events)!(user_value)    on_reduce( rule, first, lookahead - first );
+?(events)    p[ 0 ] = value( p[ 0 ].state(), size_t( first ) );
+?(syntax_tree)    // Append a node for the rule, with the nodes of its symbols as children.
+?(syntax_tree)    unsigned lookahead = (unsigned)( _position - 1 );
+?(syntax_tree)    tree_node node = { TOKEN_COUNT + rinfo.nterm, rule, p[ 0 ].state(), (unsigned)_tree.children.size(), 0, lookahead, 0 };
+?(syntax_tree)    for ( size_t i = 0; i < length; ++i )
+?(syntax_tree)    {
+?(syntax_tree)        _tree.children.push_back( (unsigned)p[ i ].get< size_t >() );
+?(syntax_tree)    }
+?(syntax_tree)    node.upper = (unsigned)_tree.children.size();
+?(syntax_tree)    if ( length > 0 )
+?(syntax_tree)    {
+?(syntax_tree)        node.first = _tree.nodes[ _tree.children[ node.lower ] ].first;
+?(syntax_tree)    }
+?(syntax_tree)    node.length = lookahead - node.first;
+?(syntax_tree)    p[ 0 ] = value( p[ 0 ].state(), _tree.nodes.size() );
+?(syntax_tree)    _tree.nodes.push_back( node );
+
+    // Find state we've returned to after reduction.
+    int state = p[ 0 ].state();
+
+    // Remove excess elements.
+    if ( length > 1 )
+    {
+        pop_values( s->head, length - 1 );
+    }
+
+    // Goto next state.
+    int goto_state = lookup_goto( state, rinfo.nterm );
+    assert( goto_state < STATE_COUNT );
+    s->state = goto_state;
+
+#ifdef POMELO_TRACE
+    dump_stacks();
+#endif
+}
+
+void $(class_name)::pull_values( stack* s, size_t length )
+{
     assert( s->head->refcount == 1 );
-    while ( s->head->values.size() < length )
+    while ( s->head->size < length )
     {
 #ifdef POMELO_TRACE
         dump_stack( s );
 #endif
 
-        piece* prev = s->head->prev;
+        piece* head = s->head;
+        piece* prev = head->prev;
         assert( prev );
         
-        if ( prev->refcount == 1 )
+        if ( prev->refcount == 1 && ! prev->base )
         {
             /*
                 prev->prev <- prev <- s->head <- s
@@ -570,37 +1801,52 @@ void $(class_name)::reduce_rule( stack* s, int rule, const rule_info& rinfo )
                 prev->prev <- s->head <- s
             */
 
-            // Move all values from this piece to the previous one.
-            prev->values.reserve( prev->values.size() + s->head->values.size() );
-            std::move
-            (
-                s->head->values.begin(),
-                s->head->values.end(),
-                std::back_inserter( prev->values )
-            );
-            
-            // Move stack to from previous piece. to this piece.
-            std::swap( prev->values, s->head->values );
-            
-            // Unlink and delete previous piece.
-            s->head->prev = prev->prev;
-            delete prev;
+            // Link the chunks of the previous piece below our own chunks.
+            if ( head->bottom )
+            {
+                head->bottom->prev = prev->top;
+            }
+            else
+            {
+                head->top = prev->top;
+            }
+            if ( prev->bottom )
+            {
+                head->bottom = prev->bottom;
+            }
+            head->size += prev->size;
+
+            // Unlink and free previous piece, which no longer owns any chunks.
+            head->prev = prev->prev;
+            prev->top = nullptr;
+            prev->bottom = nullptr;
+            prev->size = 0;
+            free_piece( prev );
         }
         else
         {
-            // Copy values from previous piece into this piece.
-            size_t rq_count = length - s->head->values.size();
-            size_t cp_count = std::min( prev->values.size(), rq_count );
-            size_t index = prev->values.size() - cp_count;
-            s->head->values.insert
-            (
-                s->head->values.begin(),
-                prev->values.begin() + index,
-                prev->values.end()
-            );
-            
-            // Split previous piece.
-            if ( index > 0 )
+            // Copy values from the top of the previous piece into this piece.
+            size_t rq_count = length - head->size;
+            size_t cp_count = std::min( prev->size, rq_count );
+            size_t index = prev->size - cp_count;
+            if ( cp_count > 0 )
+            {
+                int upper = 0;
+                chunk* c = locate( prev, prev->size - 1, &upper );
+                upper += 1;
+                for ( size_t i = 0; i < cp_count; ++i )
+                {
+                    if ( upper == c->lower )
+                    {
+                        c = c->prev;
+                        upper = c->upper;
+                    }
+                    upper -= 1;
+                    prepend_value( head, c->values()[ upper ] );
+                }
+            }
+
+            if ( index > 0 && ! prev->frozen )
             {
                 /*
                     prev->prev <- prev <- s->head <- s
@@ -610,30 +1856,43 @@ void $(class_name)::reduce_rule( stack* s, int rule, const rule_info& rinfo )
                                         <- prev
                 */
 
-                prev->refcount -= 1;
-                assert( prev->refcount > 0 );
-
                 // Create split piece and link it in.
-                piece* split = new piece { 2, prev->prev };
+                piece* split = alloc_piece( 2, prev->prev );
                 prev->prev = split;
-                s->head->prev = split;
-                
-                // Move prev's stack to the split piece.
-                std::swap( split->values, prev->values );
-                
-                // Move values after index from split to prev.
-                prev->values.reserve( cp_count );
-                std::move
-                (
-                    split->values.begin() + index,
-                    split->values.end(),
-                    std::back_inserter( prev->values )
-                );
-                split->values.erase
-                (
-                    split->values.begin() + index,
-                    split->values.end()
-                );
+                head->prev = split;
+
+                // Move values before index from prev to the split piece.
+                split_piece( prev, index, split );
+            }
+            else if ( index > 0 )
+            {
+                /*
+                    prev->prev <- prev <- s->head <- s
+
+                                        <- s->head <- s
+                    prev->prev <- view
+                                        <- prev
+                */
+
+                // A frozen piece may be shared with another thread, so rather
+                // than splitting it, create a view of the values before index.
+                piece* base = prev->base ? prev->base : prev;
+                base->refcount += 1;
+
+                if ( prev->prev )
+                {
+                    prev->prev->refcount += 1;
+                }
+
+                int upper = 0;
+                piece* view = alloc_piece( 1, prev->prev );
+                view->frozen = true;
+                view->base = base;
+                view->top = locate( prev, index - 1, &upper );
+                view->bottom = base->bottom;
+                view->limit = upper + 1;
+                view->size = index;
+                head->prev = view;
             }
             else
             {
@@ -645,47 +1904,280 @@ void $(class_name)::reduce_rule( stack* s, int rule, const rule_info& rinfo )
                                <- prev
                 */
                 
-                prev->refcount -= 1;
-                assert( prev->refcount > 0 );
-                s->head->prev = prev->prev;
+                head->prev = prev->prev;
                 if ( prev->prev )
                 {
                     prev->prev->refcount += 1;
                 }
             }
-        }
-    }
-
-#ifdef POMELO_TRACE
-    dump_stack( s );
-#endif
-
-    // Get pointer to values used to reduce.
-    std::vector< value >& values = s->head->values;
-    assert( values.size() >= length );
-    size_t index = values.size() - length;
-    value* p = values.data() + index;
 
-    // Perform rule.
-    switch ( rule )
-    {
-    case $$(rule_index): $$(rule_assign)$$(rule_name)($$(rule_args)) ); break;
+            // Release our reference to prev.
+            release_piece( prev );
+        }
     }
-    
-    // Remove excess elements.
-    values.erase( values.begin() + index + 1, values.end() );
-    
-    // Find state we've returned to after reduction, and goto next one.
-    int state = values[ index ].state();
-    int goto_state = lookup_goto( state, rinfo.nterm );
-    assert( goto_state < STATE_COUNT );
-    s->state = goto_state;
-
-#ifdef POMELO_TRACE
-    dump_stacks();
-#endif
 }
 
+?(error_token)?(position)void $(class_name)::recover( stack* s, size_t position )
+?(error_token)!(position)void $(class_name)::recover( stack* s )
+?(error_token){
+?(error_token)    // Make sure the head piece is unique before popping values from it.
+?(error_token)    assert( s->head->refcount > 0 );
+?(error_token)    if ( s->head->refcount > 1 )
+?(error_token)    {
+?(error_token)        s->head = alloc_piece( 1, s->head );
+?(error_token)    }
+?(error_token)
+?(error_token)    // Perform reductions for which the error symbol is a lookahead.  These
+?(error_token)    // are not repeated after popping, so recovery always terminates.
+?(error_token)    int action = lookup_action( s->state, ERROR_TOKEN );
+?(error_token)    while ( action >= STATE_COUNT && action < STATE_COUNT + RULE_COUNT )
+?(error_token)    {
+?(error_token)        reduce( s, ERROR_TOKEN, action - STATE_COUNT );
+?(error_token)        action = lookup_action( s->state, ERROR_TOKEN );
+?(error_token)    }
+?(error_token)
+?(error_token)    // Pop values until we reach a state which shifts the error symbol.
+?(error_token)    while ( action >= STATE_COUNT )
+?(error_token)    {
+?(error_token)        size_t depth = 0;
+?(error_token)        for ( piece* p = s->head; p && ! depth; p = p->prev )
+?(error_token)        {
+?(error_token)            depth += p->size;
+?(error_token)        }
+?(error_token)
+?(error_token)        // If no state can shift it, leave the stack in its start state.
+?(error_token)        if ( ! depth )
+?(error_token)        {
+?(error_token)            return;
+?(error_token)        }
+?(error_token)
+?(error_token)        pull_values( s, 1 );
+?(error_token)        s->state = top_values( s->head, 1 )->state();
+?(error_token)        pop_values( s->head, 1 );
+?(error_token)        action = lookup_action( s->state, ERROR_TOKEN );
+?(error_token)    }
+?(error_token)
+?(error_token)#ifdef POMELO_TRACE
+?(error_token)    printf( "SHIFT error\n" );
+?(error_token)    dump_stack( s );
+?(error_token)#endif
+?(error_token)
+?(error_token)    // Shift the error symbol, which has a default value.
+?(error_token)?(events)    push_value( s->head, value( s->state, size_t( position ) ) );
+?(error_token)?(syntax_tree)    push_value( s->head, value( s->state, tree_token( s->state, ERROR_TOKEN, position ) ) );
+?(error_token)?(syntax_tree)    _tree.nodes.back().length = 0;
+?(error_token)?(actions)?(token_type)    push_value( s->head, value( s->state, token_type() ) );
+?(error_token)?(actions)!(token_type)    push_value( s->head, value( s->state, std::nullptr_t() ) );
+?(error_token)    s->state = action;
+?(error_token)}
+?(error_token)
+?(error_repair)$(class_name)::step_result $(class_name)::finish_repair()
+?(error_repair){
+?(error_repair)    // Take the held tokens, as replaying them may start another repair.
+?(error_repair)    std::vector< int > tokens;
+?(error_repair)    tokens.swap( _repair.tokens );
+?(error_repair)?(token_type)    std::vector< token_type > tokvals;
+?(error_repair)?(token_type)    tokvals.swap( _repair.tokvals );
+?(error_repair)    _repair.active = false;
+?(error_repair)
+?(error_repair)    // Try deleting the unexpected token, then inserting a token before it,
+?(error_repair)    // then replacing it.  Keep the first repair which parses all the held
+?(error_repair)    // tokens, simulating the parse without performing any actions.
+?(error_repair)    stack* s = _anchor.next;
+?(error_repair)    int first = tokens[ 0 ];
+?(error_repair)    size_t budget = REPAIR_LIMIT;
+?(error_repair)    std::vector< int > trial;
+?(error_repair)    std::vector< int > sim;
+?(error_repair)    _repair.fix = { REPAIR_NONE, 0 };
+?(error_repair)    for ( int kind = REPAIR_DELETE; kind <= REPAIR_REPLACE && _repair.fix.kind == REPAIR_NONE && budget; ++kind )
+?(error_repair)    {
+?(error_repair)        // The end of input cannot be deleted or replaced.
+?(error_repair)        if ( first == 0 && kind != REPAIR_INSERT )
+?(error_repair)        {
+?(error_repair)            continue;
+?(error_repair)        }
+?(error_repair)
+?(error_repair)        int lower = kind == REPAIR_DELETE ? 0 : 1;
+?(error_repair)        int upper = kind == REPAIR_DELETE ? 1 : TOKEN_COUNT;
+?(error_repair)        for ( int token = lower; token < upper && budget; ++token )
+?(error_repair)        {
+?(error_repair)?(error_token)            if ( token == ERROR_TOKEN )
+?(error_repair)?(error_token)            {
+?(error_repair)?(error_token)                continue;
+?(error_repair)?(error_token)            }
+?(error_repair)            if ( kind != REPAIR_DELETE && ( token == first || ! expects( s->state, token ) ) )
+?(error_repair)            {
+?(error_repair)                continue;
+?(error_repair)            }
+?(error_repair)
+?(error_repair)            trial.clear();
+?(error_repair)            if ( kind != REPAIR_DELETE )
+?(error_repair)            {
+?(error_repair)                trial.push_back( token );
+?(error_repair)            }
+?(error_repair)            trial.insert( trial.end(), tokens.begin() + ( kind == REPAIR_INSERT ? 0 : 1 ), tokens.end() );
+?(error_repair)
+?(error_repair)            sim.clear();
+?(error_repair)            if ( simulate( s, &sim, 0, s->state, trial.data(), trial.size(), &budget ) )
+?(error_repair)            {
+?(error_repair)                _repair.fix = { (repair_kind)kind, kind == REPAIR_DELETE ? first : token };
+?(error_repair)                break;
+?(error_repair)            }
+?(error_repair)        }
+?(error_repair)    }
+?(error_repair)
+?(error_repair)    if ( _repair.fix.kind != REPAIR_NONE )
+?(error_repair)    {
+?(error_repair)        // Report the unexpected token, and apply the repair.
+?(error_repair)?(user_value)?(token_type)        error( s->u, first, tokvals[ 0 ] );
+?(error_repair)?(user_value)!(token_type)        error( s->u, first );
+?(error_repair)!(user_value)?(token_type)        error( first, tokvals[ 0 ] );
+?(error_repair)!(user_value)!(token_type)        error( first );
+?(error_repair)        if ( _repair.fix.kind == REPAIR_DELETE )
+?(error_repair)        {
+?(error_repair)            tokens.erase( tokens.begin() );
+?(error_repair)?(token_type)            tokvals.erase( tokvals.begin() );
+?(error_repair)        }
+?(error_repair)        else if ( _repair.fix.kind == REPAIR_INSERT )
+?(error_repair)        {
+?(error_repair)            tokens.insert( tokens.begin(), _repair.fix.token );
+?(error_repair)?(token_type)            tokvals.insert( tokvals.begin(), token_type() );
+?(error_repair)        }
+?(error_repair)        else
+?(error_repair)        {
+?(error_repair)            tokens[ 0 ] = _repair.fix.token;
+?(error_repair)        }
+?(error_repair)    }
+?(error_repair)    else
+?(error_repair)    {
+?(error_repair)        // No repair was found, so handle the error as usual.
+?(error_repair)        _repair.skip = true;
+?(error_repair)    }
+?(error_repair)
+?(error_repair)    // Parse the tokens, which completes the repair within this call.
+?(error_repair)    step_result result = STEP_DONE;
+?(error_repair)    for ( size_t i = 0; i < tokens.size() && result != STEP_STOPPED; ++i )
+?(error_repair)    {
+?(error_repair)        size_t budget = SIZE_MAX;
+?(error_repair)?(token_type)        result = parse_token( tokens[ i ], tokvals[ i ], &budget );
+?(error_repair)!(token_type)        result = parse_token( tokens[ i ], &budget );
+?(error_repair)        _repair.skip = false;
+?(error_repair)    }
+?(error_repair)
+?(error_repair)    return result;
+?(error_repair)}
+?(error_repair)
+?(simulate)bool $(class_name)::simulate( stack* s, std::vector< int >* sim, size_t depth, int state, const int* tokens, size_t count, size_t* budget )
+?(simulate){
+?(simulate)    // Follow the actions for each token using only states.  sim holds the
+?(simulate)    // states pushed by the simulation, and depth counts the values popped
+?(simulate)    // from the real stack.
+?(simulate)    size_t i = 0;
+?(simulate)    while ( i < count )
+?(simulate)    {
+?(simulate)        if ( *budget == 0 )
+?(simulate)        {
+?(simulate)            return false;
+?(simulate)        }
+?(simulate)        *budget -= 1;
+?(simulate)
+?(simulate)        int action = lookup_action( state, tokens[ i ] );
+?(simulate)        if ( action < STATE_COUNT )
+?(simulate)        {
+?(simulate)            sim->push_back( state );
+?(simulate)            state = action;
+?(simulate)            i += 1;
+?(simulate)        }
+?(simulate)        else if ( action < STATE_COUNT + RULE_COUNT )
+?(simulate)        {
+?(simulate)            if ( ! simulate_reduce( s, sim, &depth, &state, action - STATE_COUNT ) )
+?(simulate)            {
+?(simulate)                return false;
+?(simulate)            }
+?(simulate)        }
+?(simulate)        else if ( action < STATE_COUNT + RULE_COUNT + CONFLICT_COUNT )
+?(simulate)        {
+?(simulate)            // Succeed if any of the conflicting actions succeeds.
+?(simulate)            const unsigned short* conflict = CONFLICT + action - STATE_COUNT - RULE_COUNT;
+?(simulate)            for ( int j = 1; j < conflict[ 0 ]; ++j )
+?(simulate)            {
+?(simulate)                std::vector< int > split = *sim;
+?(simulate)                size_t split_depth = depth;
+?(simulate)                int split_state = state;
+?(simulate)                size_t next = i;
+?(simulate)                if ( conflict[ j ] < STATE_COUNT )
+?(simulate)                {
+?(simulate)                    split.push_back( split_state );
+?(simulate)                    split_state = conflict[ j ];
+?(simulate)                    next += 1;
+?(simulate)                }
+?(simulate)                else if ( ! simulate_reduce( s, &split, &split_depth, &split_state, conflict[ j ] - STATE_COUNT ) )
+?(simulate)                {
+?(simulate)                    continue;
+?(simulate)                }
+?(simulate)
+?(simulate)                if ( simulate( s, &split, split_depth, split_state, tokens + next, count - next, budget ) )
+?(simulate)                {
+?(simulate)                    return true;
+?(simulate)                }
+?(simulate)            }
+?(simulate)            return false;
+?(simulate)        }
+?(simulate)        else
+?(simulate)        {
+?(simulate)            return action == ACCEPT_ACTION;
+?(simulate)        }
+?(simulate)    }
+?(simulate)
+?(simulate)    return true;
+?(simulate)}
+?(simulate)
+?(simulate)bool $(class_name)::simulate_reduce( stack* s, std::vector< int >* sim, size_t* depth, int* state, int rule )
+?(simulate){
+?(simulate)    // Find the state before the first value of the rule, which may be on
+?(simulate)    // the real stack below the simulated states.
+?(simulate)    const rule_info& rinfo = RULE[ rule ];
+?(simulate)    size_t length = rinfo.length;
+?(simulate)    int prior = *state;
+?(simulate)    if ( length <= sim->size() )
+?(simulate)    {
+?(simulate)        if ( length > 0 )
+?(simulate)        {
+?(simulate)            prior = sim->at( sim->size() - length );
+?(simulate)            sim->resize( sim->size() - length );
+?(simulate)        }
+?(simulate)    }
+?(simulate)    else
+?(simulate)    {
+?(simulate)        size_t below = length - sim->size();
+?(simulate)        prior = stack_state( s, *depth + below - 1 );
+?(simulate)        if ( prior < 0 )
+?(simulate)        {
+?(simulate)            return false;
+?(simulate)        }
+?(simulate)        *depth += below;
+?(simulate)        sim->clear();
+?(simulate)    }
+?(simulate)
+?(simulate)    sim->push_back( prior );
+?(simulate)    *state = lookup_goto( prior, rinfo.nterm );
+?(simulate)    return true;
+?(simulate)}
+?(simulate)
+?(simulate)int $(class_name)::stack_state( stack* s, size_t index )
+?(simulate){
+?(simulate)    // Find the state recorded with the value index places below the top.
+?(simulate)    for ( piece* p = s->head; p; p = p->prev )
+?(simulate)    {
+?(simulate)        if ( index < p->size )
+?(simulate)        {
+?(simulate)            return piece_value( p, p->size - 1 - index ).state();
+?(simulate)        }
+?(simulate)        index -= p->size;
+?(simulate)    }
+?(simulate)    return -1;
+?(simulate)}
+?(simulate)
 ?(user_value)?(token_type)void $(class_name)::error( const user_value& u, int token, const token_type& tokval )
 ?(user_value)!(token_type)void $(class_name)::error( const user_value& u, int token )
 !(user_value)?(token_type)void $(class_name)::error( int token, const token_type& tokval )
@@ -694,49 +2186,1397 @@ void $(class_name)::reduce_rule( stack* s, int rule, const rule_info& rinfo )
     $(error_report)
 }
 
+?(events)?(user_value)?(token_type)void $(class_name)::on_shift( const user_value& u, int token, const token_type& tokval )
+?(events)?(user_value)!(token_type)void $(class_name)::on_shift( const user_value& u, int token )
+?(events)!(user_value)?(token_type)void $(class_name)::on_shift( int token, const token_type& tokval )
+?(events)!(user_value)!(token_type)void $(class_name)::on_shift( int token )
+?(events){
+?(events)    $(on_shift)
+?(events)}
+?(events)
+?(events)?(user_value)void $(class_name)::on_reduce( const user_value& u, int rule, size_t first, size_t length )
+?(events)!(user_value)void $(class_name)::on_reduce( int rule, size_t first, size_t length )
+?(events){
+?(events)    $(on_reduce)
+?(events)}
+
+?(yield)void $(class_name)::yield( int nterm, const value& v )
+?(yield){
+?(yield)    // Copy the value, as it remains on the stack for the enclosing rule.
+?(yield)    switch ( nterm )
+?(yield)    {
+?(yield)    case $$(yield_index): $$(yield_queue).push_back( v.get< $$(yield_type) >() ); break;
+?(yield)    }
+?(yield)}
+?(yield)
+?(yield)bool $(class_name)::$$(yield_name)( $$(yield_type)& v ) { if ( $$(yield_queue).empty() ) return false; v = std::move( $$(yield_queue).front() ); $$(yield_queue).pop_front(); return true; }
+?(yield)
+
+?(syntax_tree)size_t $(class_name)::tree_token( int state, int token, size_t position )
+?(syntax_tree){
+?(syntax_tree)    // Tokens are leaves, covering only themselves.
+?(syntax_tree)    unsigned lower = (unsigned)_tree.children.size();
+?(syntax_tree)    _tree.nodes.push_back( { token, -1, state, lower, lower, (unsigned)position, 1 } );
+?(syntax_tree)    return _tree.nodes.size() - 1;
+?(syntax_tree)}
+
 
 $(class_name)::stack* $(class_name)::split_stack( stack* prev, stack* s )
 {
     // Create new piece to be the head of the stack.
-    piece* p = new piece { 1, s->head };
+    piece* p = alloc_piece( 1, s->head );
     p->prev->refcount += 1;
 
     // Create new stack.
-?(user_value)    stack* split = new stack { user_split( s->u ), s->state, p, prev, prev->next };
-!(user_value)    stack* split = new stack { s->state, p, prev, prev->next };
+    stack* split = alloc_stack();
+?(user_value)    split->u = user_split( s->u );
+    split->state = s->state;
+    split->head = p;
+    split->prev = prev;
+    split->next = prev->next;
     split->prev->next = split;
     split->next->prev = split;
 
     return split;
 }
 
-?(user_value)$(class_name)::user_value $(class_name)::user_split( const user_value& u )
+?(predicates)?(token_type)int $(class_name)::filter_conflict( stack* s, int action, int token, const token_type& tokval, const unsigned short** conflict )
+?(predicates)!(token_type)int $(class_name)::filter_conflict( stack* s, int action, int token, const unsigned short** conflict )
+?(predicates){
+?(predicates)    // Keep the actions of the conflict whose predicates pass.
+?(predicates)    const unsigned short* actions = CONFLICT + action - STATE_COUNT - RULE_COUNT;
+?(predicates)    _filtered.resize( actions[ 0 ] );
+?(predicates)    int count = 1;
+?(predicates)    for ( int i = 1; i < actions[ 0 ]; ++i )
+?(predicates)    {
+?(predicates)?(token_type)        if ( test_predicates( s, actions[ i ], token, tokval ) )
+?(predicates)!(token_type)        if ( test_predicates( s, actions[ i ], token ) )
+?(predicates)        {
+?(predicates)            _filtered[ count++ ] = actions[ i ];
+?(predicates)        }
+?(predicates)    }
+?(predicates)
+?(predicates)    // Only split if more than one alternative remains.
+?(predicates)    if ( count == 1 )
+?(predicates)    {
+?(predicates)        return ERROR_ACTION;
+?(predicates)    }
+?(predicates)    else if ( count == 2 )
+?(predicates)    {
+?(predicates)        return _filtered[ 1 ];
+?(predicates)    }
+?(predicates)    else if ( count == actions[ 0 ] )
+?(predicates)    {
+?(predicates)        *conflict = actions;
+?(predicates)    }
+?(predicates)    else
+?(predicates)    {
+?(predicates)        _filtered[ 0 ] = count;
+?(predicates)        *conflict = _filtered.data();
+?(predicates)    }
+?(predicates)    return action;
+?(predicates)}
+?(predicates)
+?(predicates)?(token_type)bool $(class_name)::test_predicates( stack* s, int action, int token, const token_type& tokval )
+?(predicates)!(token_type)bool $(class_name)::test_predicates( stack* s, int action, int token )
+?(predicates){
+?(predicates)    // An action passes if it has no predicates, or if any of them pass.
+?(predicates)    int lower = PREDICATE_INDEX[ action ];
+?(predicates)    int upper = PREDICATE_INDEX[ action + 1 ];
+?(predicates)    if ( lower == upper )
+?(predicates)    {
+?(predicates)        return true;
+?(predicates)    }
+?(predicates)
+?(predicates)    for ( int i = lower; i < upper; ++i )
+?(predicates)    {
+?(predicates)        bool pass = false;
+?(predicates)        switch ( PREDICATES[ i ] )
+?(predicates)        {
+?(predicates)?(user_value)?(token_type)        case $$(pred_index): pass = $$(pred_name)( s->u, token, tokval ); break;
+?(predicates)?(user_value)!(token_type)        case $$(pred_index): pass = $$(pred_name)( s->u, token ); break;
+?(predicates)!(user_value)?(token_type)        case $$(pred_index): pass = $$(pred_name)( token, tokval ); break;
+?(predicates)!(user_value)!(token_type)        case $$(pred_index): pass = $$(pred_name)( token ); break;
+?(predicates)        }
+?(predicates)
+?(predicates)        if ( pass )
+?(predicates)        {
+?(predicates)            return true;
+?(predicates)        }
+?(predicates)    }
+?(predicates)
+?(predicates)    return false;
+?(predicates)}
+?(predicates)
+?(lookahead)bool $(class_name)::lookahead_waits( int state, int token )
+?(lookahead){
+?(lookahead)    // Check if the next token can decide the conflict on this token.
+?(lookahead)    for ( int i = LOOKAHEAD_INDEX[ state ]; i < LOOKAHEAD_INDEX[ state + 1 ]; ++i )
+?(lookahead)    {
+?(lookahead)        if ( LOOKAHEAD[ i ].token == token )
+?(lookahead)        {
+?(lookahead)            return true;
+?(lookahead)        }
+?(lookahead)    }
+?(lookahead)    return false;
+?(lookahead)}
+?(lookahead)
+?(lookahead)int $(class_name)::lookahead_action( int state, int token, int next, int action )
+?(lookahead){
+?(lookahead)    // Find the action the next token selects, or keep the conflict.
+?(lookahead)    for ( int i = LOOKAHEAD_INDEX[ state ]; i < LOOKAHEAD_INDEX[ state + 1 ]; ++i )
+?(lookahead)    {
+?(lookahead)        const lookahead_info& info = LOOKAHEAD[ i ];
+?(lookahead)        if ( info.token == token && info.next == next )
+?(lookahead)        {
+?(lookahead)            return info.action;
+?(lookahead)        }
+?(lookahead)    }
+?(lookahead)    return action;
+?(lookahead)}
+?(lookahead)
+?(lookahead)$(class_name)::step_result $(class_name)::resume_ahead( int next, size_t* budget )
+?(lookahead){
+?(lookahead)    if ( ! _ahead.waiting )
+?(lookahead)    {
+?(lookahead)        return STEP_DONE;
+?(lookahead)    }
+?(lookahead)
+?(lookahead)    // Parse the waiting token, deciding conflicts with the next token.  If
+?(lookahead)    // the next token is not known, pass TOKEN_COUNT, and conflicts split.
+?(lookahead)    _ahead.waiting = false;
+?(lookahead)    _ahead.deciding = true;
+?(lookahead)    _ahead.next = next;
+?(lookahead)    return finish_ahead( _anchor.next, budget );
+?(lookahead)}
+?(lookahead)
+?(lookahead)$(class_name)::step_result $(class_name)::finish_ahead( stack* first, size_t* budget )
+?(lookahead){
+?(lookahead)    // If the budget runs out, the token stays held until parse_step
+?(lookahead)    // continues it from the stack it reached.
+?(lookahead)?(token_type)?(position)    step_result result = parse_stacks( first, _ahead.token, _ahead.tokval.front(), _ahead.position, budget );
+?(lookahead)?(token_type)!(position)    step_result result = parse_stacks( first, _ahead.token, _ahead.tokval.front(), budget );
+?(lookahead)!(token_type)?(position)    step_result result = parse_stacks( first, _ahead.token, _ahead.position, budget );
+?(lookahead)!(token_type)!(position)    step_result result = parse_stacks( first, _ahead.token, budget );
+?(lookahead)    if ( result != STEP_MORE )
+?(lookahead)    {
+?(lookahead)        _ahead.deciding = false;
+?(lookahead)?(token_type)        _ahead.tokval.clear();
+?(lookahead)    }
+?(lookahead)    return result;
+?(lookahead)}
+?(lookahead)
+void $(class_name)::accept( stack* s )
+{
+    // The value of the entry symbol is on top of the accepting stack, and
+    // was pushed in the start state for that entry.
+    pull_values( s, 1 );
+    value& v = piece_value( s->head, s->head->size - 1 );
+    int state = v.state();
+?(syntax_tree)    _tree.root = (unsigned)v.get< size_t >();
+    switch ( state )
+    {
+?(parse_accept)?(user_value)    case $(start_state): parse_accept( s->u, v.move< $(start_type) >() ); break;
+?(parse_accept)!(user_value)    case $(start_state): parse_accept( v.move< $(start_type) >() ); break;
+?(user_value)    case $$(entry_state): $$(entry_name)( s->u, v.move< $$(entry_type) >() ); break;
+!(user_value)    case $$(entry_state): $$(entry_name)( v.move< $$(entry_type) >() ); break;
+    }
+?(parse_accept)
+?(parse_accept)    // Discard other parses of this document and restart from the same
+?(parse_accept)    // entry, with the user value of the stack which accepted.
+?(parse_accept)?(position)    size_t position = _position;
+?(parse_accept)?(user_value)    user_value u( std::move( s->u ) );
+?(parse_accept)?(user_value)    start( state, u );
+?(parse_accept)!(user_value)    start( state );
+?(parse_accept)?(position)    _position = position;
+}
+
+?(user_value)?(parse_accept)void $(class_name)::parse_accept( const user_value& u, $(start_type)&& result )
+!(user_value)?(parse_accept)void $(class_name)::parse_accept( $(start_type)&& result )
+?(parse_accept){
+?(parse_accept)    $(parse_accept)
+?(parse_accept)}
+?(parse_accept)
+?(user_value)void $(class_name)::$$(entry_name)( const user_value& u, $$(entry_type)&& result ) { $$(entry_body) }
+!(user_value)void $(class_name)::$$(entry_name)( $$(entry_type)&& result ) { $$(entry_body) }
+
+?(user_value)$(class_name)::user_value $(class_name)::user_split( const user_value& u )
 ?(user_value){
 ?(user_value)    $(user_split)
 ?(user_value)}
 
 void $(class_name)::delete_stack( stack* s )
 {
-    // Delete stack pieces.
-    while ( s->head )
+    // Delete stack pieces, unless stepping, when they are released later.
+    if ( _step.defer )
+    {
+        _step.released.push_back( s->head );
+    }
+    else
     {
-        s->head->refcount -= 1;
-        if ( s->head->refcount == 0 )
+        release_piece( s->head );
+    }
+    
+    // Unlink and then free stack object itself.
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+    free_stack( s );
+}
+
+
+$(class_name)::piece* $(class_name)::share_head( stack* s )
+{
+    // Add a reference to the stack's values.  The stack continues with a new
+    // empty head, so values in the shared piece are not reduced in place.  If
+    // the head is already empty, share the piece below it instead.
+    piece* p = s->head;
+    if ( p->size == 0 )
+    {
+        p = p->prev;
+    }
+    else
+    {
+        s->head = alloc_piece( 1, p );
+    }
+
+    if ( p )
+    {
+        p->refcount += 1;
+    }
+
+    return p;
+}
+
+void $(class_name)::drain( size_t* budget )
+{
+    // Release pieces of stacks deleted while stepping, one piece at a time.
+    while ( *budget && _step.released.size() )
+    {
+        *budget -= 1;
+        piece* p = _step.released.back();
+        _step.released.pop_back();
+        if ( --p->refcount > 0 )
         {
-            piece* prev = s->head->prev;
-            delete s->head;
-            s->head = prev;
+            continue;
         }
-        else
+
+        if ( p->prev )
+        {
+            _step.released.push_back( p->prev );
+        }
+
+        // Release the base of a view later, rather than recursively.
+        if ( p->base )
+        {
+            _step.released.push_back( p->base );
+            p->base = nullptr;
+            p->top = nullptr;
+            p->bottom = nullptr;
+            p->size = 0;
+        }
+
+        free_piece( p );
+    }
+}
+
+void $(class_name)::release_piece( piece* p )
+{
+    // Release reference, freeing pieces which are no longer referenced.
+    while ( p )
+    {
+        if ( --p->refcount > 0 )
         {
             break;
         }
+
+        piece* prev = p->prev;
+        free_piece( p );
+        p = prev;
     }
-    
-    // Unlink and then delete stack object itself.
-    s->prev->next = s->next;
-    s->next->prev = s->prev;
-    delete s;
+}
+
+
+/*
+    Parallel parsing.  Each chunk of tokens after the first is parsed on its
+    own thread, starting from every state which could shift the chunk's first
+    token.  A speculative stack which needs values from before its start
+    blocks, leaving a fragment.  Once all stacks have blocked or failed, a new
+    segment of the chunk begins at the earliest point at which a stack blocked.
+    Chunks are then stitched together in order by continuing the real parse
+    with the fragments that start from the state it actually reached.
+*/
+
+?(token_type)bool $(class_name)::parse_parallel( size_t count, const int* tokens, const token_type* tokvals, unsigned threads )
+!(token_type)bool $(class_name)::parse_parallel( size_t count, const int* tokens, unsigned threads )
+{
+?(ordered)    // Events, tree nodes, and yielded values must be produced in order, and
+?(ordered)    // the parse must stop at the first stop_after nonterminal, so parse on
+?(ordered)    // a single thread.
+?(ordered)    threads = 1;
+?(ordered)
+    // Split tokens into chunks.  Near each split point, start the chunk at the
+    // token which can be shifted from the fewest states.
+    std::vector< size_t > bounds;
+    bounds.push_back( 0 );
+    for ( unsigned k = 1; k < threads && _anchor.next != &_anchor; ++k )
+    {
+        size_t lower = std::max( bounds.back() + 1, count * k / threads );
+        size_t upper = std::min( count, lower + 64 );
+        size_t split = upper;
+        int split_count = 0;
+        for ( size_t i = lower; i < upper; ++i )
+        {
+            int token = tokens[ i ];
+            int state_count = TOKEN_STATE_INDEX[ token + 1 ] - TOKEN_STATE_INDEX[ token ];
+            if ( state_count > 0 && ( split == upper || state_count < split_count ) )
+            {
+                split = i;
+                split_count = state_count;
+            }
+        }
+
+        if ( split < upper )
+        {
+            bounds.push_back( split );
+        }
+    }
+    bounds.push_back( count );
+
+    // Start a speculative parser for each chunk after the first.
+    size_t chunk_count = bounds.size() - 1;
+    std::vector< speculation > speculations( chunk_count );
+    std::vector< std::unique_ptr< $(class_name) > > workers( chunk_count );
+    std::vector< std::thread > worker_threads( chunk_count );
+
+    // Wait for the workers however this function exits, as they use the
+    // token arrays and their parsers.
+    struct joiner
+    {
+        std::vector< std::thread >& threads;
+        ~joiner()
+        {
+            for ( std::thread& t : threads )
+            {
+                if ( t.joinable() )
+                {
+                    t.join();
+                }
+            }
+        }
+    };
+    joiner join_workers { worker_threads };
+
+    for ( size_t k = 1; k < chunk_count; ++k )
+    {
+        $(class_name)* worker = new $(class_name)( fork_tag() );
+        workers[ k ].reset( worker );
+        worker->_speculation = &speculations[ k ];
+?(user_value)        worker->reset( user_split( _anchor.next->u ) );
+!(user_value)        worker->reset();
+
+        size_t lower = bounds[ k ];
+        size_t upper = bounds[ k + 1 ];
+        worker_threads[ k ] = std::thread( [ = ]()
+        {
+            // Pass exceptions back, to be rethrown when the chunk is stitched.
+            try
+            {
+?(token_type)                worker->speculate( lower, upper, tokens, tokvals );
+!(token_type)                worker->speculate( lower, upper, tokens );
+            }
+            catch ( ... )
+            {
+                worker->_speculation->failure = std::current_exception();
+            }
+        } );
+    }
+
+    // Parse the first chunk, then stitch on each speculative chunk in order.
+    for ( size_t i = bounds[ 0 ]; i < bounds[ 1 ]; ++i )
+    {
+?(stop_after)?(token_type)        if ( parse( tokens[ i ], tokvals[ i ] ) )
+?(stop_after)!(token_type)        if ( parse( tokens[ i ] ) )
+?(stop_after)        {
+?(stop_after)            return true;
+?(stop_after)        }
+!(stop_after)?(token_type)        parse( tokens[ i ], tokvals[ i ] );
+!(stop_after)!(token_type)        parse( tokens[ i ] );
+    }
+
+    for ( size_t k = 1; k < chunk_count; ++k )
+    {
+        worker_threads[ k ].join();
+        if ( speculations[ k ].failure )
+        {
+            std::rethrow_exception( speculations[ k ].failure );
+        }
+?(token_type)        stitch( workers[ k ].get(), bounds[ k ], bounds[ k + 1 ], tokens, tokvals );
+!(token_type)        stitch( workers[ k ].get(), bounds[ k ], bounds[ k + 1 ], tokens );
+        workers[ k ].reset();
+    }
+
+?(stop_after)    return _done;
+!(stop_after)    return false;
+}
+
+?(token_type)void $(class_name)::speculate( size_t lower, size_t upper, const int* tokens, const token_type* tokvals )
+!(token_type)void $(class_name)::speculate( size_t lower, size_t upper, const int* tokens )
+{
+    // The parser is set up with a single stack holding the user value.
+?(user_value)    user_value u = _anchor.next->u;
+    delete_stack( _anchor.next );
+
+    size_t start = lower;
+    while ( start < upper )
+    {
+        // Start a stack in each state which can shift the first token.
+        _speculation->segments.push_back( { start, {} } );
+        int token = tokens[ start ];
+        for ( int i = TOKEN_STATE_INDEX[ token ]; i < TOKEN_STATE_INDEX[ token + 1 ]; ++i )
+        {
+            stack* s = alloc_stack();
+?(user_value)            s->u = u;
+            s->state = TOKEN_STATES[ i ];
+            s->head = alloc_piece( 1, nullptr );
+            s->prev = _anchor.prev;
+            s->next = &_anchor;
+            s->prev->next = s;
+            s->next->prev = s;
+        }
+
+        // Parse until every stack has blocked or failed.
+        for ( size_t i = start; i < upper && _anchor.next != &_anchor; ++i )
+        {
+            _speculation->position = i;
+?(token_type)            parse( tokens[ i ], tokvals[ i ] );
+!(token_type)            parse( tokens[ i ] );
+        }
+
+        // Stacks which reach the end of the chunk are also fragments.
+        _speculation->position = upper;
+        while ( _anchor.next != &_anchor )
+        {
+            block( _anchor.next );
+        }
+
+        // Begin next segment at the earliest point at which a stack blocked.
+        size_t restart = upper;
+        for ( const fragment& f : _speculation->segments.back().fragments )
+        {
+            if ( f.end > start )
+            {
+                restart = std::min( restart, f.end );
+            }
+        }
+        start = restart;
+    }
+}
+
+?(token_type)void $(class_name)::stitch( $(class_name)* worker, size_t lower, size_t upper, const int* tokens, const token_type* tokvals )
+!(token_type)void $(class_name)::stitch( $(class_name)* worker, size_t lower, size_t upper, const int* tokens )
+{
+    size_t position = lower;
+    for ( segment& seg : worker->_speculation->segments )
+    {
+        // Skip segments which start before the current position.
+        if ( seg.start < position )
+        {
+            continue;
+        }
+
+        // Parse up to the start of the segment.
+        for ( ; position < seg.start; ++position )
+        {
+?(token_type)            parse( tokens[ position ], tokvals[ position ] );
+!(token_type)            parse( tokens[ position ] );
+        }
+
+        // Continue from the matching fragment, if there is one.
+?(lookahead)        size_t budget = SIZE_MAX;
+?(lookahead)        resume_ahead( tokens[ position ], &budget );
+        fragment* f = match( &seg, tokens[ position ] );
+        if ( f )
+        {
+            splice( f );
+?(position)            _position += f->end - position;
+            position = f->end;
+        }
+    }
+
+    // Parse the rest of the chunk.
+    for ( ; position < upper; ++position )
+    {
+?(token_type)        parse( tokens[ position ], tokvals[ position ] );
+!(token_type)        parse( tokens[ position ] );
+    }
+}
+
+bool $(class_name)::underflows( stack* s, int action )
+{
+    // Find the number of values the action needs.
+    size_t length = 0;
+    if ( action < STATE_COUNT )
+    {
+        return false;
+    }
+    else if ( action < STATE_COUNT + RULE_COUNT )
+    {
+        length = RULE[ action - STATE_COUNT ].length;
+    }
+    else if ( action < STATE_COUNT + RULE_COUNT + CONFLICT_COUNT )
+    {
+        const unsigned short* conflict = CONFLICT + action - STATE_COUNT - RULE_COUNT;
+        for ( int i = 1; i < conflict[ 0 ]; ++i )
+        {
+            if ( conflict[ i ] >= STATE_COUNT )
+            {
+                length = std::max( length, (size_t)RULE[ conflict[ i ] - STATE_COUNT ].length );
+            }
+        }
+    }
+    else
+    {
+        // Only the real parse can accept.
+        return action == ACCEPT_ACTION;
+    }
+
+    // Check if the stack has that many values.
+    size_t size = 0;
+    for ( piece* p = s->head; p && size < length; p = p->prev )
+    {
+        size += p->size;
+    }
+    return size < length;
+}
+
+void $(class_name)::block( stack* s )
+{
+    // The stack started from the state recorded with its lowest value.
+    int entry = s->state;
+    for ( piece* p = s->head; p; p = p->prev )
+    {
+        if ( p->size )
+        {
+            entry = piece_value( p, 0 ).state();
+        }
+    }
+
+    // Record the fragment, which takes ownership of the stack's pieces.
+    _speculation->segments.back().fragments.push_back( { entry, s->state, _speculation->position, s->head } );
+    s->head = nullptr;
+    delete_stack( s );
+}
+
+$(class_name)::fragment* $(class_name)::match( segment* seg, int token )
+{
+    // Fragments can only continue a single stack.
+    stack* s = _anchor.next;
+    if ( s == &_anchor || s->next != &_anchor )
+    {
+        return nullptr;
+    }
+
+?(lazy)    // Tokens in a lazy region being skipped must be counted.
+?(lazy)    if ( _skip.depth )
+?(lazy)    {
+?(lazy)        return nullptr;
+?(lazy)    }
+?(lazy)
+?(error_repair)    // Tokens held while choosing a repair must be repaired in order.
+?(error_repair)    if ( _repair.active )
+?(error_repair)    {
+?(error_repair)        return nullptr;
+?(error_repair)    }
+?(error_repair)
+
+    // Perform reductions until the stack is ready to shift the token.
+    while ( true )
+    {
+        int action = lookup_action( s->state, token );
+        if ( action < STATE_COUNT )
+        {
+            break;
+        }
+        else if ( action < STATE_COUNT + RULE_COUNT )
+        {
+            reduce( s, token, action - STATE_COUNT );
+        }
+        else
+        {
+            return nullptr;
+        }
+    }
+
+    // Find fragment parsed from this state.  If the speculative parse split,
+    // then continue normally.
+    fragment* match = nullptr;
+    for ( fragment& f : seg->fragments )
+    {
+        if ( f.entry == s->state )
+        {
+            if ( match )
+            {
+                return nullptr;
+            }
+            match = &f;
+        }
+    }
+    return match;
+}
+
+void $(class_name)::splice( fragment* f )
+{
+    // Move values from the fragment onto the stack, from the bottom up.
+    stack* s = _anchor.next;
+    std::vector< piece* > pieces;
+    for ( piece* p = f->head; p; p = p->prev )
+    {
+        pieces.push_back( p );
+    }
+
+    std::vector< value* > values;
+    for ( auto i = pieces.rbegin(); i != pieces.rend(); ++i )
+    {
+        gather_values( *i, &values );
+        for ( auto j = values.rbegin(); j != values.rend(); ++j )
+        {
+            push_value( s->head, std::move( **j ) );
+        }
+    }
+
+    s->state = f->state;
+}
+
+
+/*
+    Incremental parsing.  Each tree node records the state in which its symbol
+    was pushed.  The old tree is kept, and new nodes are appended to it.  While
+    there is a single stack, a nonterminal from the old tree which starts at
+    the current token and was pushed from the current state is pushed again in
+    place, provided that neither the node nor the lookahead token which
+    followed it were damaged by the edit.  A cursor tracks the path from the old
+    root to the current token.
+*/
+
+?(syntax_tree)?(user_value)?(token_type)void $(class_name)::reparse( const user_value& u, const tree_edit& edit, size_t count, const int* tokens, const token_type* tokvals )
+?(syntax_tree)?(user_value)!(token_type)void $(class_name)::reparse( const user_value& u, const tree_edit& edit, size_t count, const int* tokens )
+?(syntax_tree)!(user_value)?(token_type)void $(class_name)::reparse( const tree_edit& edit, size_t count, const int* tokens, const token_type* tokvals )
+?(syntax_tree)!(user_value)!(token_type)void $(class_name)::reparse( const tree_edit& edit, size_t count, const int* tokens )
+?(syntax_tree){
+?(syntax_tree)    // Restart in the state in which the old root was parsed.
+?(syntax_tree)    std::vector< unsigned > path;
+?(syntax_tree)    int state = START_STATE;
+?(syntax_tree)    if ( _tree.root < _tree.nodes.size() )
+?(syntax_tree)    {
+?(syntax_tree)        path.push_back( _tree.root );
+?(syntax_tree)        state = _tree.nodes[ _tree.root ].state;
+?(syntax_tree)    }
+?(syntax_tree)?(user_value)    start( state, u );
+?(syntax_tree)!(user_value)    start( state );
+?(syntax_tree)
+?(syntax_tree)    // Nodes after the edit move by the change in length.
+?(syntax_tree)    unsigned delta = (unsigned)( edit.lower + edit.length - edit.upper );
+?(syntax_tree)    std::vector< unsigned > work;
+?(syntax_tree)
+?(syntax_tree)    size_t position = 0;
+?(syntax_tree)    while ( position < count )
+?(syntax_tree)    {
+?(syntax_tree)        // Find the old position of undamaged tokens.
+?(syntax_tree)        size_t old_position = SIZE_MAX;
+?(syntax_tree)        if ( position < edit.lower )
+?(syntax_tree)        {
+?(syntax_tree)            old_position = position;
+?(syntax_tree)        }
+?(syntax_tree)        else if ( position >= edit.lower + edit.length )
+?(syntax_tree)        {
+?(syntax_tree)            old_position = position - edit.lower - edit.length + edit.upper;
+?(syntax_tree)        }
+?(syntax_tree)
+?(syntax_tree)?(lookahead)        // Parse any waiting token before comparing states.
+?(syntax_tree)?(lookahead)        size_t budget = SIZE_MAX;
+?(syntax_tree)?(lookahead)        resume_ahead( tokens[ position ], &budget );
+?(syntax_tree)?(lookahead)
+?(syntax_tree)        stack* s = _anchor.next;
+?(syntax_tree)        if ( old_position != SIZE_MAX && path.size() && s != &_anchor && s->next == &_anchor )
+?(syntax_tree)        {
+?(syntax_tree)            // Move the cursor out of nodes which end before the old position,
+?(syntax_tree)            // and down into the nodes which contain it.
+?(syntax_tree)            while ( path.size() && _tree.nodes[ path.back() ].first + _tree.nodes[ path.back() ].length <= old_position )
+?(syntax_tree)            {
+?(syntax_tree)                path.pop_back();
+?(syntax_tree)            }
+?(syntax_tree)            while ( path.size() )
+?(syntax_tree)            {
+?(syntax_tree)                const tree_node& node = _tree.nodes[ path.back() ];
+?(syntax_tree)                unsigned next = UINT_MAX;
+?(syntax_tree)                for ( unsigned i = node.lower; i < node.upper; ++i )
+?(syntax_tree)                {
+?(syntax_tree)                    const tree_node& child = _tree.nodes[ _tree.children[ i ] ];
+?(syntax_tree)                    if ( child.first + child.length > old_position )
+?(syntax_tree)                    {
+?(syntax_tree)                        next = child.first <= old_position ? _tree.children[ i ] : UINT_MAX;
+?(syntax_tree)                        break;
+?(syntax_tree)                    }
+?(syntax_tree)                }
+?(syntax_tree)                if ( next == UINT_MAX )
+?(syntax_tree)                {
+?(syntax_tree)                    break;
+?(syntax_tree)                }
+?(syntax_tree)                path.push_back( next );
+?(syntax_tree)            }
+?(syntax_tree)
+?(syntax_tree)            // Nodes on the path which start here are candidates for reuse.
+?(syntax_tree)            size_t lowest = path.size();
+?(syntax_tree)            while ( lowest > 0 && _tree.nodes[ path[ lowest - 1 ] ].first == old_position )
+?(syntax_tree)            {
+?(syntax_tree)                lowest -= 1;
+?(syntax_tree)            }
+?(syntax_tree)
+?(syntax_tree)            // Perform reductions on the lookahead until a candidate can be
+?(syntax_tree)            // pushed.  Reductions see the lookahead as the token being parsed.
+?(syntax_tree)            int token = tokens[ position ];
+?(syntax_tree)            size_t match = SIZE_MAX;
+?(syntax_tree)            _position += 1;
+?(syntax_tree)            while ( true )
+?(syntax_tree)            {
+?(syntax_tree)                for ( size_t i = lowest; i < path.size(); ++i )
+?(syntax_tree)                {
+?(syntax_tree)                    const tree_node& node = _tree.nodes[ path[ i ] ];
+?(syntax_tree)                    if ( node.rule >= 0 && node.length && node.state == s->state
+?(syntax_tree)                        && ( node.first + node.length < edit.lower || node.first >= edit.upper ) )
+?(syntax_tree)                    {
+?(syntax_tree)                        match = i;
+?(syntax_tree)                        break;
+?(syntax_tree)                    }
+?(syntax_tree)                }
+?(syntax_tree)
+?(syntax_tree)                int action = lookup_action( s->state, token );
+?(syntax_tree)                if ( match != SIZE_MAX || action < STATE_COUNT || action >= STATE_COUNT + RULE_COUNT )
+?(syntax_tree)                {
+?(syntax_tree)                    break;
+?(syntax_tree)                }
+?(syntax_tree)
+?(syntax_tree)                reduce( s, token, action - STATE_COUNT );
+?(syntax_tree)            }
+?(syntax_tree)            _position -= 1;
+?(syntax_tree)
+?(syntax_tree)            if ( match != SIZE_MAX )
+?(syntax_tree)            {
+?(syntax_tree)                // Leave the reused node, then move it to its new position.
+?(syntax_tree)                unsigned n = path[ match ];
+?(syntax_tree)                path.resize( match );
+?(syntax_tree)                if ( delta && _tree.nodes[ n ].first >= edit.upper )
+?(syntax_tree)                {
+?(syntax_tree)                    work.assign( 1, n );
+?(syntax_tree)                    while ( work.size() )
+?(syntax_tree)                    {
+?(syntax_tree)                        tree_node& node = _tree.nodes[ work.back() ];
+?(syntax_tree)                        work.pop_back();
+?(syntax_tree)                        node.first += delta;
+?(syntax_tree)                        work.insert( work.end(), _tree.children.begin() + node.lower, _tree.children.begin() + node.upper );
+?(syntax_tree)                    }
+?(syntax_tree)                }
+?(syntax_tree)
+?(syntax_tree)                // Push the node and move to the state after it.
+?(syntax_tree)                const tree_node& node = _tree.nodes[ n ];
+?(syntax_tree)                push_value( s->head, value( s->state, (size_t)n ) );
+?(syntax_tree)                s->state = lookup_goto( s->state, node.kind - TOKEN_COUNT );
+?(syntax_tree)                assert( s->state < STATE_COUNT );
+?(syntax_tree)                _position += node.length;
+?(syntax_tree)                position += node.length;
+?(syntax_tree)                continue;
+?(syntax_tree)            }
+?(syntax_tree)        }
+?(syntax_tree)
+?(syntax_tree)?(token_type)        parse( tokens[ position ], tokvals[ position ] );
+?(syntax_tree)!(token_type)        parse( tokens[ position ] );
+?(syntax_tree)        position += 1;
+?(syntax_tree)    }
+?(syntax_tree)}
+
+
+/*
+    Lazy parsing.  When a token can only open a lazy nonterminal, and there is
+    a single stack, the parser skips tokens up to the matching close delimiter
+    and pushes a placeholder value.  The token range and the state in which the
+    region was skipped are enough to parse the region later.
+*/
+
+?(lazy)?(user_value)?(token_type)$$(lazy_type) $(class_name)::parse_$$(lazy_name)( const user_value& u, const lazy_range& range, const int* tokens, const token_type* tokvals ) { assert( range.nterm == $$(lazy_index) ); value v = parse_lazy( u, range, tokens, tokvals ); return v.kind() >= 0 ? v.move< $$(lazy_type) >() : $$(lazy_type)(); }
+?(lazy)?(user_value)!(token_type)$$(lazy_type) $(class_name)::parse_$$(lazy_name)( const user_value& u, const lazy_range& range, const int* tokens ) { assert( range.nterm == $$(lazy_index) ); value v = parse_lazy( u, range, tokens ); return v.kind() >= 0 ? v.move< $$(lazy_type) >() : $$(lazy_type)(); }
+?(lazy)!(user_value)?(token_type)$$(lazy_type) $(class_name)::parse_$$(lazy_name)( const lazy_range& range, const int* tokens, const token_type* tokvals ) { assert( range.nterm == $$(lazy_index) ); value v = parse_lazy( range, tokens, tokvals ); return v.kind() >= 0 ? v.move< $$(lazy_type) >() : $$(lazy_type)(); }
+?(lazy)!(user_value)!(token_type)$$(lazy_type) $(class_name)::parse_$$(lazy_name)( const lazy_range& range, const int* tokens ) { assert( range.nterm == $$(lazy_index) ); value v = parse_lazy( range, tokens ); return v.kind() >= 0 ? v.move< $$(lazy_type) >() : $$(lazy_type)(); }
+?(lazy)
+?(lazy)bool $(class_name)::open_lazy( stack* s, int token, size_t position )
+?(lazy){
+?(lazy)    // Check if the token opens a lazy nonterminal in this state.
+?(lazy)    for ( int i = LAZY_INDEX[ token ]; i < LAZY_INDEX[ token + 1 ]; ++i )
+?(lazy)    {
+?(lazy)        const lazy_info& lazy = LAZY_STATES[ i ];
+?(lazy)        if ( lazy.state == s->state )
+?(lazy)        {
+?(lazy)            _skip.depth = 1;
+?(lazy)            _skip.open = token;
+?(lazy)            _skip.close = lazy.close;
+?(lazy)            _skip.range = { lazy.nterm, s->state, position, position };
+?(memoize)            _skip.memo = lazy.memo;
+?(memoize)            _skip.tokens.clear();
+?(memoize)?(token_type)            _skip.tokvals.clear();
+?(lazy)            return true;
+?(lazy)        }
+?(lazy)    }
+?(lazy)    return false;
+?(lazy)}
+?(lazy)
+?(lazy)void $(class_name)::close_lazy( size_t position )
+?(lazy){
+?(lazy)    // The stack is still in the state before the open delimiter.
+?(lazy)    stack* s = _anchor.next;
+?(lazy)    assert( s->state == _skip.range.state );
+?(lazy)    _skip.depth = 0;
+?(lazy)    _skip.range.upper = position + 1;
+?(lazy)
+?(memoize)    // Memoized regions are parsed now, or found in the memo table.
+?(memoize)    if ( _skip.memo )
+?(memoize)    {
+?(memoize)        push_value( s->head, recall( s ) );
+?(memoize)        _skip.tokens.clear();
+?(memoize)?(token_type)        _skip.tokvals.clear();
+?(memoize)    }
+?(memoize)
+?(lazy)    // Push placeholder and move to the state after the nonterminal.
+?(lazy)    switch ( _skip.range.nterm )
+?(lazy)    {
+?(lazy)?(user_value)    case $$(lazy_index): push_value( s->head, value( s->state, $$(lazy_name)( s->u, _skip.range ) ) ); break;
+?(lazy)!(user_value)    case $$(lazy_index): push_value( s->head, value( s->state, $$(lazy_name)( _skip.range ) ) ); break;
+?(lazy)    }
+?(lazy)
+?(lazy)    int goto_state = lookup_goto( s->state, _skip.range.nterm );
+?(lazy)    assert( goto_state < STATE_COUNT );
+?(lazy)    s->state = goto_state;
+?(lazy)}
+?(lazy)
+?(lazy)?(user_value)?(token_type)$(class_name)::value $(class_name)::parse_lazy( const user_value& u, const lazy_range& range, const int* tokens, const token_type* tokvals )
+?(lazy)?(user_value)!(token_type)$(class_name)::value $(class_name)::parse_lazy( const user_value& u, const lazy_range& range, const int* tokens )
+?(lazy)!(user_value)?(token_type)$(class_name)::value $(class_name)::parse_lazy( const lazy_range& range, const int* tokens, const token_type* tokvals )
+?(lazy)!(user_value)!(token_type)$(class_name)::value $(class_name)::parse_lazy( const lazy_range& range, const int* tokens )
+?(lazy){
+?(lazy)    // Start a parser in the state in which the region was skipped.
+?(lazy)    $(class_name) p( fork_tag{} );
+?(lazy)?(user_value)    p.reset( u );
+?(lazy)!(user_value)    p.reset();
+?(memoize)    p._memo = _memo;
+?(lazy)    stack* s = p._anchor.next;
+?(lazy)    s->state = range.state;
+?(lazy)
+?(lazy)    // Shift the open delimiter directly, as parsing it would skip again.
+?(lazy)    size_t position = range.lower;
+?(lazy)    int action = lookup_action( s->state, tokens[ position ] );
+?(lazy)    assert( action < STATE_COUNT );
+?(lazy)?(token_type)    p.push_value( s->head, value( s->state, token_type( tokvals[ position ] ) ) );
+?(lazy)!(token_type)    p.push_value( s->head, value( s->state, std::nullptr_t() ) );
+?(lazy)    s->state = action;
+?(lazy)    p._position = ++position;
+?(lazy)
+?(lazy)    // Parse the rest of the region.  Nested lazy regions are skipped.
+?(lazy)    for ( ; position < range.upper; ++position )
+?(lazy)    {
+?(lazy)?(token_type)        p.parse( tokens[ position ], tokvals[ position ] );
+?(lazy)!(token_type)        p.parse( tokens[ position ] );
+?(lazy)    }
+?(lazy)?(lookahead)    size_t budget = SIZE_MAX;
+?(lazy)?(lookahead)    p.resume_ahead( TOKEN_COUNT, &budget );
+?(lazy)
+?(lazy)    // The close delimiter ends the nonterminal, so any stack which reduces
+?(lazy)    // it does so whatever the lookahead.
+?(lazy)    for ( s = p._anchor.next; s != &p._anchor; s = s->next )
+?(lazy)    {
+?(lazy)        for ( int token = 0; token < TOKEN_COUNT; ++token )
+?(lazy)        {
+?(lazy)            int action = lookup_action( s->state, token );
+?(lazy)            if ( action < STATE_COUNT || action >= STATE_COUNT + RULE_COUNT )
+?(lazy)            {
+?(lazy)                continue;
+?(lazy)            }
+?(lazy)
+?(lazy)            int rule = action - STATE_COUNT;
+?(lazy)            const rule_info& rinfo = RULE[ rule ];
+?(lazy)            if ( rinfo.nterm == range.nterm )
+?(lazy)            {
+?(lazy)                p.reduce_rule( s, rule, rinfo );
+?(lazy)                return std::move( p.piece_value( s->head, s->head->size - 1 ) );
+?(lazy)            }
+?(lazy)        }
+?(lazy)    }
+?(lazy)
+?(lazy)    // The region did not parse.
+?(lazy)    return value();
+?(lazy)}
+?(memoize)
+?(memoize)struct $(class_name)::memo_entry
+?(memoize){
+?(memoize)    int state;
+?(memoize)    std::vector< int > tokens;
+?(memoize)?(token_type)    std::vector< token_type > tokvals;
+?(memoize)    value result;
+?(memoize)};
+?(memoize)
+?(memoize)struct $(class_name)::memo_table
+?(memoize){
+?(memoize)    std::unordered_multimap< uint64_t, memo_entry > entries;
+?(memoize)};
+?(memoize)
+?(memoize)void $(class_name)::clear_memo()
+?(memoize){
+?(memoize)    _memo.reset();
+?(memoize)}
+?(memoize)
+?(memoize)?(token_type)void $(class_name)::remember( int token, const token_type& tokval )
+?(memoize)!(token_type)void $(class_name)::remember( int token )
+?(memoize){
+?(memoize)    // The tokens in a memoized region are its key in the memo table.
+?(memoize)    if ( _skip.memo )
+?(memoize)    {
+?(memoize)        _skip.tokens.push_back( token );
+?(memoize)?(token_type)        _skip.tokvals.push_back( tokval );
+?(memoize)    }
+?(memoize)}
+?(memoize)
+?(memoize)$(class_name)::value $(class_name)::recall( stack* s )
+?(memoize){
+?(memoize)    // Hash the state the region starts in and the tokens in the region.
+?(memoize)    uint64_t hash = UINT64_C( 14695981039346656037 );
+?(memoize)    hash = ( hash ^ (uint64_t)s->state ) * UINT64_C( 1099511628211 );
+?(memoize)    for ( int token : _skip.tokens )
+?(memoize)    {
+?(memoize)        hash = ( hash ^ (uint64_t)token ) * UINT64_C( 1099511628211 );
+?(memoize)    }
+?(memoize)
+?(memoize)    // Look for an identical region which has been parsed before.
+?(memoize)    if ( ! _memo )
+?(memoize)    {
+?(memoize)        _memo = std::make_shared< memo_table >();
+?(memoize)    }
+?(memoize)
+?(memoize)    auto found = _memo->entries.equal_range( hash );
+?(memoize)    for ( auto i = found.first; i != found.second; ++i )
+?(memoize)    {
+?(memoize)        const memo_entry& entry = i->second;
+?(memoize)        bool same = entry.state == s->state && entry.tokens == _skip.tokens;
+?(memoize)?(token_type)        same = same && entry.tokvals == _skip.tokvals;
+?(memoize)        if ( same )
+?(memoize)        {
+?(memoize)            return entry.result;
+?(memoize)        }
+?(memoize)    }
+?(memoize)
+?(memoize)    // Parse the region.
+?(memoize)    lazy_range range = { _skip.range.nterm, s->state, 0, _skip.tokens.size() };
+?(memoize)?(user_value)?(token_type)    value result = parse_lazy( s->u, range, _skip.tokens.data(), _skip.tokvals.data() );
+?(memoize)?(user_value)!(token_type)    value result = parse_lazy( s->u, range, _skip.tokens.data() );
+?(memoize)!(user_value)?(token_type)    value result = parse_lazy( range, _skip.tokens.data(), _skip.tokvals.data() );
+?(memoize)!(user_value)!(token_type)    value result = parse_lazy( range, _skip.tokens.data() );
+?(memoize)
+?(memoize)    // Errors have been reported for a region which did not parse.  Don't
+?(memoize)    // remember it, so that they are reported again if it repeats.
+?(memoize)    if ( result.kind() < 0 )
+?(memoize)    {
+?(memoize)        switch ( range.nterm )
+?(memoize)        {
+?(memoize)        case $$(memo_index): result = value( s->state, $$(memo_type)() ); break;
+?(memoize)        }
+?(memoize)        return result;
+?(memoize)    }
+?(memoize)
+?(memoize)    memo_entry entry;
+?(memoize)    entry.state = s->state;
+?(memoize)    entry.tokens = _skip.tokens;
+?(memoize)?(token_type)    entry.tokvals = _skip.tokvals;
+?(memoize)    entry.result = result;
+?(memoize)    _memo->entries.emplace( hash, std::move( entry ) );
+?(memoize)    return result;
+?(memoize)}
+
+
+/*
+    Snapshots.
+*/
+
+$(class_name)::snapshot::snapshot()
+    :   _parser( nullptr )
+?(position)    ,   _position( 0 )
+?(lazy)    ,   _skip()
+?(stop_after)    ,   _done( false )
+?(error_token)    ,   _recovering( 0 )
+?(error_repair)    ,   _repair()
+?(lookahead)    ,   _ahead()
+{
+}
+
+$(class_name)::snapshot::snapshot( snapshot&& s )
+    :   _parser( s._parser )
+    ,   _entries( std::move( s._entries ) )
+?(position)    ,   _position( s._position )
+?(lazy)    ,   _skip( s._skip )
+?(stop_after)    ,   _done( s._done )
+?(error_token)    ,   _recovering( s._recovering )
+?(error_repair)    ,   _repair( std::move( s._repair ) )
+?(lookahead)    ,   _ahead( std::move( s._ahead ) )
+{
+    s._parser = nullptr;
+    s._entries.clear();
+}
+
+$(class_name)::snapshot& $(class_name)::snapshot::operator = ( snapshot&& s )
+{
+    if ( &s != this )
+    {
+        release();
+        _parser = s._parser;
+        _entries = std::move( s._entries );
+?(position)        _position = s._position;
+?(lazy)        _skip = s._skip;
+?(stop_after)        _done = s._done;
+?(error_token)        _recovering = s._recovering;
+?(error_repair)        _repair = std::move( s._repair );
+?(lookahead)        _ahead = std::move( s._ahead );
+        s._parser = nullptr;
+        s._entries.clear();
+    }
+    return *this;
+}
+
+$(class_name)::snapshot::~snapshot()
+{
+    release();
+}
+
+void $(class_name)::snapshot::release()
+{
+    for ( const entry& e : _entries )
+    {
+        _parser->release_piece( e.head );
+    }
+    _entries.clear();
+    _parser = nullptr;
+}
+
+
+/*
+    Stack storage.
+*/
+
+$(class_name)::piece* $(class_name)::alloc_piece( int refcount, piece* prev )
+{
+    piece* p = _free_pieces;
+    if ( p )
+    {
+        _free_pieces = p->prev;
+    }
+    else
+    {
+        p = new piece;
+    }
+
+    p->refcount = refcount;
+    p->frozen = false;
+    p->prev = prev;
+    p->base = nullptr;
+    p->top = nullptr;
+    p->bottom = nullptr;
+    p->limit = 0;
+    p->size = 0;
+    return p;
+}
+
+void $(class_name)::free_piece( piece* p )
+{
+    if ( p->base )
+    {
+        // A view does not own its chunks.
+        release_piece( p->base );
+        p->top = nullptr;
+        p->bottom = nullptr;
+        p->size = 0;
+    }
+    else
+    {
+        clear_piece( p );
+    }
+
+    p->prev = _free_pieces;
+    _free_pieces = p;
+}
+
+$(class_name)::stack* $(class_name)::alloc_stack()
+{
+    stack* s = _free_stacks;
+    if ( s )
+    {
+        _free_stacks = s->next;
+    }
+    else
+    {
+        s = new stack {};
+    }
+
+    return s;
+}
+
+void $(class_name)::free_stack( stack* s )
+{
+?(user_value)    s->u = user_value();
+    s->head = nullptr;
+    s->next = _free_stacks;
+    _free_stacks = s;
+}
+
+$(class_name)::chunk* $(class_name)::alloc_chunk()
+{
+    chunk* c = _free_chunks;
+    if ( c )
+    {
+        _free_chunks = c->prev;
+    }
+    else
+    {
+        c = new chunk;
+    }
+
+    c->prev = nullptr;
+    c->lower = 0;
+    c->upper = 0;
+    return c;
+}
+
+void $(class_name)::free_chunk( chunk* c )
+{
+    assert( c->lower == c->upper );
+    c->prev = _free_chunks;
+    _free_chunks = c;
+}
+
+void $(class_name)::push_value( piece* p, value&& v )
+{
+    // Start a new chunk if the top chunk is full.
+    chunk* c = p->top;
+    if ( ! c || c->upper == CHUNK_SIZE )
+    {
+        c = alloc_chunk();
+        c->prev = p->top;
+        p->top = c;
+        if ( ! p->bottom )
+        {
+            p->bottom = c;
+        }
+    }
+
+    new ( c->values() + c->upper ) value( std::move( v ) );
+    c->upper += 1;
+    p->size += 1;
+}
+
+void $(class_name)::prepend_value( piece* p, const value& v )
+{
+    // Start a new chunk, filled from the end, if the bottom chunk is full.
+    chunk* c = p->bottom;
+    if ( ! c || c->lower == 0 )
+    {
+        c = alloc_chunk();
+        c->lower = CHUNK_SIZE;
+        c->upper = CHUNK_SIZE;
+        if ( p->bottom )
+        {
+            p->bottom->prev = c;
+        }
+        else
+        {
+            p->top = c;
+        }
+        p->bottom = c;
+    }
+
+    c->lower -= 1;
+    new ( c->values() + c->lower ) value( v );
+    p->size += 1;
+}
+
+void $(class_name)::pop_values( piece* p, size_t count )
+{
+    assert( count <= p->size );
+    p->size -= count;
+    while ( count-- )
+    {
+        chunk* c = p->top;
+        c->upper -= 1;
+        c->values()[ c->upper ].~value();
+        if ( c->lower == c->upper )
+        {
+            p->top = c->prev;
+            if ( ! p->top )
+            {
+                p->bottom = nullptr;
+            }
+            free_chunk( c );
+        }
+    }
+}
+
+$(class_name)::value* $(class_name)::top_values( piece* p, size_t count )
+{
+    // Rules are never longer than a chunk.
+    assert( count <= p->size && count <= (size_t)CHUNK_SIZE );
+    chunk* c = p->top;
+    if ( (size_t)c->size() < count )
+    {
+        // Move the values in the top chunk up to the end of the chunk.
+        value* v = c->values();
+        int shift = CHUNK_SIZE - c->upper;
+        if ( shift > 0 )
+        {
+            for ( int i = c->upper - 1; i >= c->lower; --i )
+            {
+                new ( v + i + shift ) value( std::move( v[ i ] ) );
+                v[ i ].~value();
+            }
+            c->lower += shift;
+            c->upper += shift;
+        }
+
+        // Move the remaining values up from the chunks below.
+        while ( (size_t)c->size() < count )
+        {
+            chunk* b = c->prev;
+            b->upper -= 1;
+            c->lower -= 1;
+            new ( v + c->lower ) value( std::move( b->values()[ b->upper ] ) );
+            b->values()[ b->upper ].~value();
+            if ( b->lower == b->upper )
+            {
+                c->prev = b->prev;
+                if ( p->bottom == b )
+                {
+                    p->bottom = c;
+                }
+                free_chunk( b );
+            }
+        }
+    }
+
+    return c->values() + c->upper - count;
+}
+
+$(class_name)::value& $(class_name)::piece_value( piece* p, size_t index )
+{
+    int slot = 0;
+    chunk* c = locate( p, index, &slot );
+    return c->values()[ slot ];
+}
+
+$(class_name)::chunk* $(class_name)::locate( piece* p, size_t index, int* slot )
+{
+    // Walk down from the top chunk to the chunk containing the value.  The
+    // top chunk of a view is only used up to its limit.
+    assert( index < p->size );
+    size_t above = p->size - index;
+    chunk* c = p->top;
+    int upper = p->base ? p->limit : c->upper;
+    while ( above > (size_t)( upper - c->lower ) )
+    {
+        above -= upper - c->lower;
+        c = c->prev;
+        upper = c->upper;
+    }
+
+    *slot = upper - (int)above;
+    return c;
+}
+
+void $(class_name)::gather_values( piece* p, std::vector< value* >* values )
+{
+    // List values from the top of the piece down.
+    values->clear();
+    if ( p->size )
+    {
+        int upper = 0;
+        chunk* c = locate( p, p->size - 1, &upper );
+        upper += 1;
+        while ( values->size() < p->size )
+        {
+            if ( upper == c->lower )
+            {
+                c = c->prev;
+                upper = c->upper;
+            }
+            upper -= 1;
+            values->push_back( c->values() + upper );
+        }
+    }
+}
+
+void $(class_name)::split_piece( piece* p, size_t index, piece* split )
+{
+    // Find the chunk containing the split point.
+    assert( index > 0 && index < p->size );
+    size_t above = p->size - index;
+    chunk* upper = nullptr;
+    chunk* c = p->top;
+    while ( above >= (size_t)c->size() )
+    {
+        above -= c->size();
+        upper = c;
+        c = c->prev;
+    }
+
+    // Move values above the split point out into a new chunk.
+    if ( above > 0 )
+    {
+        chunk* n = alloc_chunk();
+        value* v = c->values();
+        for ( int i = c->upper - (int)above; i < c->upper; ++i )
+        {
+            new ( n->values() + n->upper ) value( std::move( v[ i ] ) );
+            v[ i ].~value();
+            n->upper += 1;
+        }
+        c->upper -= (int)above;
+
+        if ( upper )
+        {
+            upper->prev = n;
+        }
+        else
+        {
+            p->top = n;
+        }
+        upper = n;
+    }
+
+    // Chunks from c down belong to the split piece.
+    upper->prev = nullptr;
+    split->top = c;
+    split->bottom = p->bottom;
+    split->size = index;
+    p->bottom = upper;
+    p->size -= index;
+}
+
+void $(class_name)::clear_piece( piece* p )
+{
+    while ( p->top )
+    {
+        chunk* c = p->top;
+        for ( int i = c->lower; i < c->upper; ++i )
+        {
+            c->values()[ i ].~value();
+        }
+        c->lower = c->upper;
+        p->top = c->prev;
+        free_chunk( c );
+    }
+
+    p->bottom = nullptr;
+    p->size = 0;
 }
 
 
@@ -761,7 +3601,7 @@ void $(class_name)::dump_stack( stack* s )
     printf( "    %p->%d :", s, s->state );
     for ( piece* p = s->head; p; p = p->prev )
     {
-        printf( " -> %p/%d/%zu", p, p->refcount, p->values.size() );
+        printf( " -> %p/%d/%zu", p, p->refcount.load(), p->size );
     }
     printf( "\n" );
 }
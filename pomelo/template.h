@@ -26,6 +26,10 @@
 #define $(include_guard)
 
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <exception>
+?(yield)#include <deque>
 
 $(include_header)
 
@@ -45,35 +49,135 @@ class $(class_name)
 {
 public:
 
+    class snapshot;
+
     static const char* symbol_name( int kind );
 
 ?(user_value)    typedef $(user_value) user_value;
 ?(token_type)    typedef $(token_type) token_type;
+?(writer_type)    typedef $(writer_type) writer_type;
+?(reader_type)    typedef $(reader_type) reader_type;
+?(lexer)    typedef $(lexer) lexer_type;
+
+?(error_repair)    enum repair_kind { REPAIR_NONE, REPAIR_DELETE, REPAIR_INSERT, REPAIR_REPLACE };
+?(error_repair)    struct repair_info
+?(error_repair)    {
+?(error_repair)        repair_kind kind;
+?(error_repair)        int token;
+?(error_repair)    };
+?(error_repair)
+    struct token_set
+    {
+        unsigned short words[ $(token_words) ];
+        bool test( int token ) const { return ( words[ token / 16 ] >> ( token % 16 ) ) & 1; }
+    };
+
+?(lazy)    struct lazy_range
+?(lazy)    {
+?(lazy)        int nterm;
+?(lazy)        int state;
+?(lazy)        size_t lower;
+?(lazy)        size_t upper;
+?(lazy)    };
+
+?(syntax_tree)    struct tree_node
+?(syntax_tree)    {
+?(syntax_tree)        int kind;
+?(syntax_tree)        int rule;
+?(syntax_tree)        int state;
+?(syntax_tree)        unsigned lower;
+?(syntax_tree)        unsigned upper;
+?(syntax_tree)        unsigned first;
+?(syntax_tree)        unsigned length;
+?(syntax_tree)    };
+?(syntax_tree)
+?(syntax_tree)    struct syntax_tree
+?(syntax_tree)    {
+?(syntax_tree)        std::vector< tree_node > nodes;
+?(syntax_tree)        std::vector< unsigned > children;
+?(syntax_tree)        unsigned root;
+?(syntax_tree)    };
+?(syntax_tree)
+?(syntax_tree)    struct tree_edit
+?(syntax_tree)    {
+?(syntax_tree)        size_t lower;
+?(syntax_tree)        size_t upper;
+?(syntax_tree)        size_t length;
+?(syntax_tree)    };
     
 ?(user_value)    explicit $(class_name)( const user_value& u );
 !(user_value)    $(class_name)();
     ~$(class_name)();
     
-?(token_type)    void parse( int token, const token_type& tokval );
-!(token_type)    void parse( int token );
+?(token_type)    bool parse( int token, const token_type& tokval );
+!(token_type)    bool parse( int token );
+
+    enum step_result { STEP_DONE, STEP_MORE, STEP_STOPPED };
+?(token_type)    step_result parse_step( int token, const token_type& tokval, size_t budget );
+!(token_type)    step_result parse_step( int token, size_t budget );
+    step_result parse_step( size_t budget );
+?(lexer)    bool parse_all( lexer_type& lexer );
+?(yield)    bool $$(yield_name)( $$(yield_type)& v );
+?(scanner)    size_t parse_text( const char* text, size_t length );
+?(scanner)    static int scan( const char* text, size_t length, size_t* match );
+    bool expects( int state, int token );
+?(error_repair)    const repair_info& repair() const { return _repair.fix; }
+    void expected_tokens( token_set& expected );
+
+?(token_type)    bool parse_parallel( size_t count, const int* tokens, const token_type* tokvals, unsigned threads );
+!(token_type)    bool parse_parallel( size_t count, const int* tokens, unsigned threads );
+
+?(user_value)    void reset( const user_value& u );
+!(user_value)    void reset();
+?(user_value)    void parse_as( int entry, const user_value& u );
+!(user_value)    void parse_as( int entry );
+
+    snapshot checkpoint();
+    void restore( const snapshot& snap );
+    std::unique_ptr< $(class_name) > fork();
+
+?(syntax_tree)    const syntax_tree& tree() const { return _tree; }
+?(syntax_tree)?(user_value)?(token_type)    void reparse( const user_value& u, const tree_edit& edit, size_t count, const int* tokens, const token_type* tokvals );
+?(syntax_tree)?(user_value)!(token_type)    void reparse( const user_value& u, const tree_edit& edit, size_t count, const int* tokens );
+?(syntax_tree)!(user_value)?(token_type)    void reparse( const tree_edit& edit, size_t count, const int* tokens, const token_type* tokvals );
+?(syntax_tree)!(user_value)!(token_type)    void reparse( const tree_edit& edit, size_t count, const int* tokens );
+
+?(memoize)    void clear_memo();
+
+?(writer_type)    void serialize( writer_type& w );
+?(reader_type)    bool deserialize( reader_type& r );
+
+?(lazy)?(user_value)?(token_type)    $$(lazy_type) parse_$$(lazy_name)( const user_value& u, const lazy_range& range, const int* tokens, const token_type* tokvals );
+?(lazy)?(user_value)!(token_type)    $$(lazy_type) parse_$$(lazy_name)( const user_value& u, const lazy_range& range, const int* tokens );
+?(lazy)!(user_value)?(token_type)    $$(lazy_type) parse_$$(lazy_name)( const lazy_range& range, const int* tokens, const token_type* tokvals );
+?(lazy)!(user_value)!(token_type)    $$(lazy_type) parse_$$(lazy_name)( const lazy_range& range, const int* tokens );
 
 
 private:
 
     class value;
+    struct chunk;
 
     struct rule_info
     {
         unsigned short nterm;
-        unsigned short length   : 15;
+        unsigned short length   : 13;
         unsigned short merges   : 1;
+        unsigned short stops    : 1;
+        unsigned short yields   : 1;
+        unsigned short dprec;
     };
 
     struct piece
     {
-        int refcount;
+        std::atomic< int > refcount;
+        bool frozen;
         piece* prev;
-        std::vector< value > values;
+        piece* base;
+        chunk* top;
+        chunk* bottom;
+        int limit;
+        size_t size;
     };
     
     struct stack
@@ -85,14 +189,108 @@ private:
         stack* next;
     };
 
+    struct fork_tag {};
+
+    struct start_info
+    {
+        unsigned short nterm;
+        unsigned short state;
+    };
+
+?(lazy)    struct lazy_info
+?(lazy)    {
+?(lazy)        unsigned short state;
+?(lazy)        unsigned short nterm;
+?(lazy)        unsigned short close;
+?(lazy)        bool memo;
+?(lazy)    };
+?(lazy)
+?(lazy)    struct lazy_skip
+?(lazy)    {
+?(lazy)        int depth;
+?(lazy)        int open;
+?(lazy)        int close;
+?(lazy)        lazy_range range;
+?(memoize)        bool memo;
+?(memoize)        std::vector< int > tokens;
+?(memoize)?(token_type)        std::vector< token_type > tokvals;
+?(lazy)    };
+?(memoize)
+?(memoize)    struct memo_entry;
+?(memoize)    struct memo_table;
+
+?(error_repair)    struct repair_state
+?(error_repair)    {
+?(error_repair)        bool active;
+?(error_repair)        bool skip;
+?(error_repair)        std::vector< int > tokens;
+?(error_repair)?(token_type)        std::vector< token_type > tokvals;
+?(error_repair)        repair_info fix;
+?(error_repair)    };
+?(error_repair)
+    struct step_state
+    {
+        bool pending;
+        bool defer;
+        int token;
+?(token_type)        std::vector< token_type > tokval;
+?(position)        size_t position;
+        stack* s;
+        std::vector< piece* > released;
+    };
+?(lookahead)
+?(lookahead)    struct lookahead_info
+?(lookahead)    {
+?(lookahead)        unsigned short token;
+?(lookahead)        unsigned short next;
+?(lookahead)        unsigned short action;
+?(lookahead)    };
+?(lookahead)
+?(lookahead)    struct lookahead_state
+?(lookahead)    {
+?(lookahead)        bool waiting;
+?(lookahead)        bool deciding;
+?(lookahead)        int next;
+?(lookahead)        int token;
+?(lookahead)?(token_type)        std::vector< token_type > tokval;
+?(lookahead)?(position)        size_t position;
+?(lookahead)    };
+
+    struct fragment
+    {
+        int entry;
+        int state;
+        size_t end;
+        piece* head;
+    };
+
+    struct segment
+    {
+        size_t start;
+        std::vector< fragment > fragments;
+    };
+
+    struct speculation
+    {
+        size_t position;
+        std::vector< segment > segments;
+        std::exception_ptr failure;
+    };
+
     static const int START_STATE;
     static const int TOKEN_COUNT;
+    static const int TOKEN_WORDS;
     static const int NTERM_COUNT;
     static const int STATE_COUNT;
     static const int RULE_COUNT;
     static const int CONFLICT_COUNT;
     static const int ACCEPT_ACTION;
     static const int ERROR_ACTION;
+?(error_token)    static const int ERROR_TOKEN;
+?(error_repair)    static const int REPAIR_WINDOW;
+?(error_repair)    static const int REPAIR_LIMIT;
+    static const int CHUNK_SIZE;
+    static const int GRAMMAR_HASH[];
 
     static const unsigned short ACTION_DISPLACEMENT[];
     static const unsigned short ACTION_VALUE_TABLE[];
@@ -102,21 +300,124 @@ private:
     static const unsigned short GOTO_ROW_TABLE[];
     static const unsigned short CONFLICT[];
     static const rule_info RULE[];
+    static const start_info START_STATES[];
+    static const unsigned short TOKEN_STATE_INDEX[];
+    static const unsigned short TOKEN_STATES[];
+    static const unsigned short EXPECTED_TOKENS[];
+?(lazy)    static const unsigned short LAZY_INDEX[];
+?(lazy)    static const lazy_info LAZY_STATES[];
+?(predicates)    static const unsigned short PREDICATE_INDEX[];
+?(predicates)    static const unsigned short PREDICATES[];
+?(fallback)    static const unsigned short FALLBACK[];
+?(lookahead)    static const unsigned short LOOKAHEAD_INDEX[];
+?(lookahead)    static const lookahead_info LOOKAHEAD[];
+?(scanner)    static const int SCAN_STATE_COUNT;
+?(scanner)    static const int SCAN_CLASS_COUNT;
+?(scanner)    static const unsigned char SCAN_CLASS[];
+?(scanner)    static const unsigned short SCAN_NEXT[];
+?(scanner)    static const unsigned short SCAN_ACCEPT[];
+
+    explicit $(class_name)( fork_tag );
 
-    $$(rule_type) $$(rule_name)($$(rule_param));
+?(actions)    $$(rule_type) $$(rule_name)($$(rule_param));
     $$(merge_type) $$(merge_name)( const user_value& u, $$(merge_type)&& a, user_value&& v, $$(merge_type)&& b );
+?(lazy)?(user_value)    $$(lazy_type) $$(lazy_name)( const user_value& u, const lazy_range& range );
+?(lazy)!(user_value)    $$(lazy_type) $$(lazy_name)( const lazy_range& range );
+?(user_value)?(token_type)    bool $$(pred_name)( const user_value& u, int token, const token_type& tokval );
+?(user_value)!(token_type)    bool $$(pred_name)( const user_value& u, int token );
+!(user_value)?(token_type)    bool $$(pred_name)( int token, const token_type& tokval );
+!(user_value)!(token_type)    bool $$(pred_name)( int token );
     
     int lookup_action( int state, int token );
     int lookup_goto( int state, int nterm );
+?(token_type)    step_result parse_token( int token, const token_type& tokval, size_t* budget );
+!(token_type)    step_result parse_token( int token, size_t* budget );
+?(token_type)?(position)    step_result parse_stacks( stack* first, int token, const token_type& tokval, size_t position, size_t* budget );
+?(token_type)!(position)    step_result parse_stacks( stack* first, int token, const token_type& tokval, size_t* budget );
+!(token_type)?(position)    step_result parse_stacks( stack* first, int token, size_t position, size_t* budget );
+!(token_type)!(position)    step_result parse_stacks( stack* first, int token, size_t* budget );
+?(lookahead)    bool lookahead_waits( int state, int token );
+?(lookahead)    int lookahead_action( int state, int token, int next, int action );
+?(lookahead)    step_result resume_ahead( int next, size_t* budget );
+?(lookahead)    step_result finish_ahead( stack* first, size_t* budget );
     void reduce( stack* s, int token, int rule );
     void reduce_rule( stack* s, int rule, const rule_info& rinfo );
 ?(user_value)?(token_type)    void error( const user_value& u, int token, const token_type& tokval );
 ?(user_value)!(token_type)    void error( const user_value& u, int token );
 !(user_value)?(token_type)    void error( int token, const token_type& tokval );
 !(user_value)!(token_type)    void error( int token );
+?(events)?(user_value)?(token_type)    void on_shift( const user_value& u, int token, const token_type& tokval );
+?(events)?(user_value)!(token_type)    void on_shift( const user_value& u, int token );
+?(events)!(user_value)?(token_type)    void on_shift( int token, const token_type& tokval );
+?(events)!(user_value)!(token_type)    void on_shift( int token );
+?(events)?(user_value)    void on_reduce( const user_value& u, int rule, size_t first, size_t length );
+?(events)!(user_value)    void on_reduce( int rule, size_t first, size_t length );
+?(user_value)?(parse_accept)    void parse_accept( const user_value& u, $(start_type)&& result );
+!(user_value)?(parse_accept)    void parse_accept( $(start_type)&& result );
+?(user_value)    void $$(entry_name)( const user_value& u, $$(entry_type)&& result );
+!(user_value)    void $$(entry_name)( $$(entry_type)&& result );
+    void accept( stack* s );
+?(user_value)    void start( int state, const user_value& u );
+!(user_value)    void start( int state );
+    void restore_fields( const snapshot& snap );
 ?(user_value)    user_value user_split( const user_value& u );
     stack* split_stack( stack* prev, stack* s );
     void delete_stack( stack* s );
+?(predicates)?(token_type)    int filter_conflict( stack* s, int action, int token, const token_type& tokval, const unsigned short** conflict );
+?(predicates)!(token_type)    int filter_conflict( stack* s, int action, int token, const unsigned short** conflict );
+?(predicates)?(token_type)    bool test_predicates( stack* s, int action, int token, const token_type& tokval );
+?(predicates)!(token_type)    bool test_predicates( stack* s, int action, int token );
+?(syntax_tree)    size_t tree_token( int state, int token, size_t position );
+?(yield)    void yield( int nterm, const value& v );
+?(lazy)    bool open_lazy( stack* s, int token, size_t position );
+?(lazy)    void close_lazy( size_t position );
+?(memoize)?(token_type)    void remember( int token, const token_type& tokval );
+?(memoize)!(token_type)    void remember( int token );
+?(memoize)    value recall( stack* s );
+?(lazy)?(user_value)?(token_type)    value parse_lazy( const user_value& u, const lazy_range& range, const int* tokens, const token_type* tokvals );
+?(lazy)?(user_value)!(token_type)    value parse_lazy( const user_value& u, const lazy_range& range, const int* tokens );
+?(lazy)!(user_value)?(token_type)    value parse_lazy( const lazy_range& range, const int* tokens, const token_type* tokvals );
+?(lazy)!(user_value)!(token_type)    value parse_lazy( const lazy_range& range, const int* tokens );
+?(writer_type)    template < typename T > static void write_value( writer_type& w, const T& v ) { w.write( v ); }
+?(writer_type)    static void write_value( writer_type&, std::nullptr_t ) {}
+?(writer_type)    static void write_size( writer_type& w, size_t v );
+?(reader_type)    template < typename T > static void read_value( reader_type& r, T& v ) { r.read( v ); }
+?(reader_type)    static void read_value( reader_type&, std::nullptr_t& ) {}
+?(reader_type)    static void read_size( reader_type& r, size_t& v );
+?(token_type)    void speculate( size_t lower, size_t upper, const int* tokens, const token_type* tokvals );
+!(token_type)    void speculate( size_t lower, size_t upper, const int* tokens );
+?(token_type)    void stitch( $(class_name)* worker, size_t lower, size_t upper, const int* tokens, const token_type* tokvals );
+!(token_type)    void stitch( $(class_name)* worker, size_t lower, size_t upper, const int* tokens );
+    bool underflows( stack* s, int action );
+    void block( stack* s );
+    fragment* match( segment* seg, int token );
+    void splice( fragment* f );
+    piece* share_head( stack* s );
+    void release_piece( piece* p );
+    void drain( size_t* budget );
+
+    piece* alloc_piece( int refcount, piece* prev );
+    void free_piece( piece* p );
+    stack* alloc_stack();
+    void free_stack( stack* s );
+    chunk* alloc_chunk();
+    void free_chunk( chunk* c );
+    void push_value( piece* p, value&& v );
+    void prepend_value( piece* p, const value& v );
+    void pop_values( piece* p, size_t count );
+    value* top_values( piece* p, size_t count );
+    value& piece_value( piece* p, size_t index );
+    chunk* locate( piece* p, size_t index, int* slot );
+    void gather_values( piece* p, std::vector< value* >* values );
+    void split_piece( piece* p, size_t index, piece* split );
+    void clear_piece( piece* p );
+    void pull_values( stack* s, size_t length );
+?(error_token)?(position)    void recover( stack* s, size_t position );
+?(error_token)!(position)    void recover( stack* s );
+?(error_repair)    step_result finish_repair();
+?(simulate)    bool simulate( stack* s, std::vector< int >* sim, size_t depth, int state, const int* tokens, size_t count, size_t* budget );
+?(simulate)    bool simulate_reduce( stack* s, std::vector< int >* sim, size_t* depth, int* state, int rule );
+?(simulate)    int stack_state( stack* s, size_t index );
     
 #ifdef POMELO_TRACE
     void dump_stack( stack* s );
@@ -124,6 +425,56 @@ private:
 #endif
 
     stack _anchor;
+    piece* _free_pieces;
+    stack* _free_stacks;
+    chunk* _free_chunks;
+    speculation* _speculation;
+?(position)    size_t _position;
+?(lazy)    lazy_skip _skip;
+?(memoize)    std::shared_ptr< memo_table > _memo;
+?(stop_after)    bool _done;
+?(error_token)    int _recovering;
+?(error_repair)    repair_state _repair;
+?(predicates)    std::vector< unsigned short > _filtered;
+    step_state _step;
+?(lookahead)    lookahead_state _ahead;
+?(syntax_tree)    syntax_tree _tree;
+?(yield)    std::deque< $$(yield_type) > $$(yield_queue);
+
+};
+
+
+class $(class_name)::snapshot
+{
+public:
+
+    snapshot();
+    snapshot( snapshot&& s );
+    snapshot& operator = ( snapshot&& s );
+    ~snapshot();
+
+
+private:
+
+    friend class $(class_name);
+
+    struct entry
+    {
+?(user_value)        user_value u;
+        int state;
+        piece* head;
+    };
+
+    void release();
+
+    $(class_name)* _parser;
+    std::vector< entry > _entries;
+?(position)    size_t _position;
+?(lazy)    lazy_skip _skip;
+?(stop_after)    bool _done;
+?(error_token)    int _recovering;
+?(error_repair)    repair_state _repair;
+?(lookahead)    lookahead_state _ahead;
 
 };
 
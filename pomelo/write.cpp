@@ -12,6 +12,7 @@
 
 #include "write.h"
 #include <assert.h>
+#include <stdint.h>
 #include <string_view>
 
 
@@ -27,12 +28,14 @@ write::write
         automata_ptr automata,
         action_table_ptr action_table,
         goto_table_ptr goto_table,
+        scanner_table_ptr scanner_table,
         const std::string& source,
         const std::string& output_h
     )
     :   _automata( automata )
     ,   _action_table( action_table )
     ,   _goto_table( goto_table )
+    ,   _scanner_table( scanner_table )
     ,   _source( source )
     ,   _output_h( output_h )
 {
@@ -97,11 +100,17 @@ void write::prepare()
     );
     
     
+    // Without actions, the value of every symbol is either its first token
+    // position or the index of its syntax tree node.
+    bool positions = ! condition( "actions" );
+
     // Add the token type.
     std::unordered_map< std::string, ntype* > lookup;
     std::unique_ptr< ntype > n = std::make_unique< ntype >();
     std::string type;
-    if ( _automata->syntax->token_type.specified )
+    if ( positions )
+        type = "size_t";
+    else if ( _automata->syntax->token_type.specified )
         type = trim( _automata->syntax->token_type.text );
     else
         type = "std::nullptr_t";
@@ -116,7 +125,11 @@ void write::prepare()
     for ( nonterminal* nterm : _nterms )
     {
         std::string type = trim( nterm->type );
-        if ( type.empty() )
+        if ( positions )
+        {
+            type = "size_t";
+        }
+        else if ( type.empty() )
         {
             type = "std::nullptr_t";
         }
@@ -157,12 +170,53 @@ void write::prepare()
         $(start_state)
         $(error_action)
         $(accept_action)
+        $(error_token)
         $(token_count)
+        $(token_words)
         $(nterm_count)
         $(state_count)
         $(rule_count)
         $(conflict_count)
+        $(grammar_hash)
+        $(chunk_size)
+        $(scan_state_count)
+        $(scan_class_count)
         $(error_report)
+        $(repair_window)
+        $(repair_limit)
+        $(parse_accept)
+        $(start_type)
+        $(start_nterm)
+        $(writer_type)
+        $(reader_type)
+        $(lexer)
+        $(on_shift)
+        $(on_reduce)
+ 
+    Conditional lines:
+ 
+        ?(user_value)
+        ?(token_type)
+        ?(parse_accept)
+        ?(writer_type)
+        ?(reader_type)
+        ?(lexer)
+        ?(scanner)
+        ?(lazy)
+        ?(stop_after)
+        ?(error_token)
+        ?(error_repair)
+        ?(yield)
+        ?(events)
+        ?(memoize)
+        ?(syntax_tree)
+        ?(actions)
+        ?(ordered)
+        ?(position)
+        ?(predicates)
+        ?(fallback)
+        ?(lookahead)
+        ?(simulate)
  
     Tables:
  
@@ -170,6 +224,19 @@ void write::prepare()
         $(conflict_table)
         $(goto_table)
         $(rule_table)
+        $(token_state_index)
+        $(token_state_table)
+        $(expected_table)
+        $(lazy_index)
+        $(lazy_table)
+        $(predicate_index)
+        $(predicate_table)
+        $(fallback_table)
+        $(lookahead_index)
+        $(lookahead_table)
+        $(scan_class_table)
+        $(scan_next_table)
+        $(scan_accept_table)
  
     Per-token:
  
@@ -187,6 +254,39 @@ void write::prepare()
         $$(merge_name)
         $$(merge_index)
         $$(merge_body)
+
+    Per-predicate:
+
+        $$(pred_name)
+        $$(pred_index)
+        $$(pred_body)
+
+    Per-lazy non-terminal:
+
+        $$(lazy_type)
+        $$(lazy_name)
+        $$(lazy_index)
+        $$(lazy_body)
+
+    Per-yielded non-terminal:
+
+        $$(yield_type)
+        $$(yield_name)
+        $$(yield_queue)
+        $$(yield_index)
+
+    Per-memoized non-terminal:
+
+        $$(memo_type)
+        $$(memo_index)
+
+    Per-entry non-terminal:
+
+        $$(entry_type)
+        $$(entry_name)
+        $$(entry_nterm)
+        $$(entry_state)
+        $$(entry_body)
  
     Per-non-terminal-type:
  
@@ -200,7 +300,6 @@ void write::prepare()
         $$(rule_name)
         $$(rule_param)
         $$(rule_body)
-        $$(rule_assign)
         $$(rule_args)
  
 */
@@ -217,6 +316,57 @@ bool write::write_source( FILE* f )
 }
 
 
+bool write::condition( const std::string& flag )
+{
+    syntax_ptr syntax = _automata->syntax;
+    if ( flag == "user_value" )
+        return syntax->user_value.specified;
+    if ( flag == "token_type" )
+        return syntax->token_type.specified;
+    if ( flag == "parse_accept" )
+        return syntax->parse_accept.specified;
+    if ( flag == "writer_type" )
+        return syntax->writer_type.specified;
+    if ( flag == "reader_type" )
+        return syntax->reader_type.specified;
+    if ( flag == "lexer" )
+        return syntax->lexer.specified;
+    if ( flag == "scanner" )
+        return _scanner_table != nullptr;
+    if ( flag == "stop_after" )
+        return std::any_of( _nterms.begin(), _nterms.end(), []( nonterminal* n ) { return n->stops; } );
+    if ( flag == "error_token" )
+        return syntax->error != nullptr;
+    if ( flag == "error_repair" )
+        return syntax->error_repair.specified;
+    if ( flag == "yield" )
+        return std::any_of( _nterms.begin(), _nterms.end(), []( nonterminal* n ) { return n->yields; } );
+    if ( flag == "lazy" )
+        return std::any_of( _nterms.begin(), _nterms.end(), []( nonterminal* n ) { return n->lspecified; } );
+    if ( flag == "memoize" )
+        return std::any_of( _nterms.begin(), _nterms.end(), []( nonterminal* n ) { return n->memoize; } );
+    if ( flag == "events" )
+        return syntax->on_shift.specified || syntax->on_reduce.specified;
+    if ( flag == "syntax_tree" )
+        return syntax->syntax_tree.specified;
+    if ( flag == "actions" )
+        return ! condition( "events" ) && ! condition( "syntax_tree" );
+    if ( flag == "ordered" )
+        return condition( "events" ) || condition( "syntax_tree" ) || condition( "yield" ) || condition( "stop_after" );
+    if ( flag == "position" )
+        return condition( "lazy" ) || condition( "events" ) || condition( "syntax_tree" );
+    if ( flag == "predicates" )
+        return ! syntax->predicates.empty();
+    if ( flag == "fallback" )
+        return std::any_of( _tokens.begin(), _tokens.end(), []( terminal* t ) { return t->fallback != nullptr; } );
+    if ( flag == "lookahead" )
+        return ! _action_table->lookaheads.empty();
+    if ( flag == "simulate" )
+        return condition( "error_repair" ) || condition( "lookahead" );
+    assert( ! "unknown template condition" );
+    return false;
+}
+
 bool write::write_template( FILE* f, char* source, size_t length, bool header )
 {
     // Process file line-by-line.
@@ -239,38 +389,26 @@ bool write::write_template( FILE* f, char* source, size_t length, bool header )
         std::string line( source + i, iend - i );
         std::string output;
         
-        if ( line[ 0 ] == '?' || line[ 0 ] == '!' )
+        // Lines prefixed with ?(flag) or !(flag) are conditional.
+        bool skip = false;
+        while ( line[ 0 ] == '?' || line[ 0 ] == '!' )
         {
-            syntax_ptr syntax = _automata->syntax;
-
-            bool skip = false;
-
-            if ( starts_with( line, "?(user_value)" ) )
-            {
-                skip = skip || ! syntax->user_value.specified;
-                line = line.substr( line.find( ')' ) + 1 );
-            }
-            if ( starts_with( line, "!(user_value)" ) )
-            {
-                skip = skip || syntax->user_value.specified;
-                line = line.substr( line.find( ')' ) + 1 );
-            }
-            if ( starts_with( line, "?(token_type)" ) )
-            {
-                skip = skip || ! syntax->token_type.specified;
-                line = line.substr( line.find( ')' ) + 1 );
-            }
-            if ( starts_with( line, "!(token_type)" ) )
+            size_t close = line.find( ')' );
+            if ( line[ 1 ] != '(' || close == std::string::npos )
             {
-                skip = skip || syntax->token_type.specified;
-                line = line.substr( line.find( ')' ) + 1 );
+                break;
             }
 
-            if ( skip )
-            {
-                i = iend;
-                continue;
-            }
+            bool expect = line[ 0 ] == '?';
+            std::string flag = line.substr( 2, close - 2 );
+            skip = skip || condition( flag ) != expect;
+            line = line.substr( close + 1 );
+        }
+
+        if ( skip )
+        {
+            i = iend;
+            continue;
         }
 
         // Check for interpolants.
@@ -299,6 +437,53 @@ bool write::write_template( FILE* f, char* source, size_t length, bool header )
                     output += replace( replace( line, nterm ) );
                 }
             }
+            else if ( line.compare( per, 8, "$$(pred_" ) == 0 )
+            {
+                for ( int index = 0; index < (int)_automata->syntax->predicates.size(); ++index )
+                {
+                    output += replace( replace( line, index ) );
+                }
+            }
+            else if ( line.compare( per, 8, "$$(lazy_" ) == 0 )
+            {
+                for ( nonterminal* nterm : _nterms )
+                {
+                    if ( ! nterm->lspecified || nterm->memoize )
+                    {
+                        continue;
+                    }
+                    output += replace( replace( line, nterm ) );
+                }
+            }
+            else if ( line.compare( per, 9, "$$(yield_" ) == 0 )
+            {
+                for ( nonterminal* nterm : _nterms )
+                {
+                    if ( ! nterm->yields )
+                    {
+                        continue;
+                    }
+                    output += replace( replace( line, nterm ) );
+                }
+            }
+            else if ( line.compare( per, 8, "$$(memo_" ) == 0 )
+            {
+                for ( nonterminal* nterm : _nterms )
+                {
+                    if ( ! nterm->memoize )
+                    {
+                        continue;
+                    }
+                    output += replace( replace( line, nterm ) );
+                }
+            }
+            else if ( line.compare( per, 9, "$$(entry_" ) == 0 )
+            {
+                for ( nonterminal* nterm : _automata->syntax->entries )
+                {
+                    output += replace( replace( line, nterm ) );
+                }
+            }
             else if ( line.compare( per, 9, "$$(nterm_" ) == 0 )
             {
                 for ( nonterminal* nterm : _nterms )
@@ -408,12 +593,28 @@ std::string write::replace( std::string line )
         $(start_state)
         $(error_action)
         $(accept_action)
+        $(error_token)
         $(token_count)
+        $(token_words)
         $(nterm_count)
         $(state_count)
         $(rule_count)
         $(conflict_count)
+        $(grammar_hash)
+        $(chunk_size)
+        $(scan_state_count)
+        $(scan_class_count)
         $(error_report)
+        $(repair_window)
+        $(repair_limit)
+        $(parse_accept)
+        $(start_type)
+        $(start_nterm)
+        $(writer_type)
+        $(reader_type)
+        $(lexer)
+        $(on_shift)
+        $(on_reduce)
 
         $(action_table)
         $(action_displacement)
@@ -425,6 +626,19 @@ std::string write::replace( std::string line )
         $(goto_row_table)
         $(conflict_table)
         $(rule_table)
+        $(token_state_index)
+        $(token_state_table)
+        $(expected_table)
+        $(lazy_index)
+        $(lazy_table)
+        $(predicate_index)
+        $(predicate_table)
+        $(fallback_table)
+        $(lookahead_index)
+        $(lookahead_table)
+        $(scan_class_table)
+        $(scan_next_table)
+        $(scan_accept_table)
     */
     
     syntax_ptr syntax = _automata->syntax;
@@ -511,10 +725,18 @@ std::string write::replace( std::string line )
         {
             r.replace( std::to_string( _action_table->accept_action ) );
         }
+        else if ( valname == "$(error_token)" )
+        {
+            r.replace( std::to_string( syntax->error ? syntax->error->value : -1 ) );
+        }
         else if ( valname == "$(token_count)" )
         {
             r.replace( std::to_string( _action_table->token_count ) );
         }
+        else if ( valname == "$(token_words)" )
+        {
+            r.replace( std::to_string( _action_table->token_words ) );
+        }
         else if ( valname == "$(nterm_count)" )
         {
             r.replace( std::to_string( _goto_table->nterm_count ) );
@@ -531,10 +753,71 @@ std::string write::replace( std::string line )
         {
             r.replace( std::to_string( _action_table->conflict_count ) );
         }
+        else if ( valname == "$(grammar_hash)" )
+        {
+            r.replace( write_grammar_hash() );
+        }
+        else if ( valname == "$(chunk_size)" )
+        {
+            // Chunks must be large enough to hold the values of any rule.
+            size_t chunk_size = 64;
+            for ( rule* rule : _action_table->rules )
+            {
+                chunk_size = std::max( chunk_size, rule->locount - 1 );
+            }
+            r.replace( std::to_string( chunk_size ) );
+        }
         else if ( valname == "$(error_report)" )
         {
             r.replace( trim( syntax->error_report.text ) );
         }
+        else if ( valname == "$(parse_accept)" )
+        {
+            r.replace( trim( syntax->parse_accept.text ) );
+        }
+        else if ( valname == "$(start_type)" )
+        {
+            r.replace( _nterm_lookup.at( syntax->start )->ntype );
+        }
+        else if ( valname == "$(start_nterm)" )
+        {
+            const location& loc = syntax->locations.at( syntax->start->rules.front()->lostart );
+            r.replace( std::to_string( loc.sym->value ) );
+        }
+        else if ( valname == "$(writer_type)" )
+        {
+            r.replace( trim( syntax->writer_type.text ) );
+        }
+        else if ( valname == "$(reader_type)" )
+        {
+            r.replace( trim( syntax->reader_type.text ) );
+        }
+        else if ( valname == "$(repair_window)" || valname == "$(repair_limit)" )
+        {
+            // The window size is optionally followed by the action limit.
+            const std::string& text = syntax->error_repair.text;
+            size_t comma = text.find( ',' );
+            if ( valname == "$(repair_window)" )
+            {
+                r.replace( trim( text.substr( 0, comma ) ) );
+            }
+            else
+            {
+                r.replace( comma != std::string::npos ? trim( text.substr( comma + 1 ) ) : "10000" );
+            }
+        }
+        else if ( valname == "$(lexer)" )
+        {
+            r.replace( trim( syntax->lexer.text ) );
+        }
+        else if ( valname == "$(on_shift)" )
+        {
+            r.replace( trim( syntax->on_shift.text ) );
+        }
+        else if ( valname == "$(on_reduce)" )
+        {
+            r.replace( trim( syntax->on_reduce.text ) );
+        }
         else if ( valname == "$(action_table)" )
         {
             r.replace( write_table( _action_table->actions ) );
@@ -575,6 +858,66 @@ std::string write::replace( std::string line )
         {
             r.replace( write_rule_table() );
         }
+        else if ( valname == "$(token_state_index)" )
+        {
+            r.replace( write_table( _action_table->token_state_index ) );
+        }
+        else if ( valname == "$(token_state_table)" )
+        {
+            r.replace( write_table( _action_table->token_states ) );
+        }
+        else if ( valname == "$(expected_table)" )
+        {
+            r.replace( write_table( _action_table->expected_tokens ) );
+        }
+        else if ( valname == "$(lazy_index)" )
+        {
+            r.replace( write_table( _action_table->lazy_index ) );
+        }
+        else if ( valname == "$(predicate_index)" )
+        {
+            r.replace( write_table( _action_table->predicate_index ) );
+        }
+        else if ( valname == "$(predicate_table)" )
+        {
+            r.replace( write_table( _action_table->predicates ) );
+        }
+        else if ( valname == "$(fallback_table)" )
+        {
+            r.replace( write_table( _action_table->fallbacks ) );
+        }
+        else if ( valname == "$(lookahead_index)" )
+        {
+            r.replace( write_table( _action_table->lookahead_index ) );
+        }
+        else if ( valname == "$(scan_state_count)" )
+        {
+            r.replace( std::to_string( _scanner_table ? _scanner_table->state_count : 0 ) );
+        }
+        else if ( valname == "$(scan_class_count)" )
+        {
+            r.replace( std::to_string( _scanner_table ? _scanner_table->class_count : 0 ) );
+        }
+        else if ( valname == "$(scan_class_table)" )
+        {
+            r.replace( write_table( _scanner_table->classes ) );
+        }
+        else if ( valname == "$(scan_next_table)" )
+        {
+            r.replace( write_table( _scanner_table->next ) );
+        }
+        else if ( valname == "$(scan_accept_table)" )
+        {
+            r.replace( write_table( _scanner_table->accept ) );
+        }
+        else if ( valname == "$(lazy_table)" )
+        {
+            r.replace( write_lazy_table() );
+        }
+        else if ( valname == "$(lookahead_table)" )
+        {
+            r.replace( write_lookahead_table() );
+        }
         else
         {
             fprintf( stdout, "%.*s", (int)valname.size(), valname.data() );
@@ -672,6 +1015,123 @@ std::string write::replace( std::string line, nonterminal* nterm )
             body += "\n";
             r.replace( body );
         }
+        else if ( valname == "$$(lazy_type)" )
+        {
+            r.replace( _nterm_lookup.at( nterm )->ntype );
+        }
+        else if ( valname == "$$(lazy_name)" )
+        {
+            std::string name = "lazy_";
+            name += syntax->source->text( nterm->name );
+            r.replace( name );
+        }
+        else if ( valname == "$$(lazy_index)" )
+        {
+            int index = nterm->value - _action_table->token_count;
+            r.replace( std::to_string( index ) );
+        }
+        else if ( valname == "$$(yield_type)" )
+        {
+            r.replace( _nterm_lookup.at( nterm )->ntype );
+        }
+        else if ( valname == "$$(yield_name)" )
+        {
+            std::string name = "take_";
+            name += syntax->source->text( nterm->name );
+            r.replace( name );
+        }
+        else if ( valname == "$$(yield_queue)" )
+        {
+            std::string name = "_yield_";
+            name += syntax->source->text( nterm->name );
+            r.replace( name );
+        }
+        else if ( valname == "$$(yield_index)" )
+        {
+            int index = nterm->value - _action_table->token_count;
+            r.replace( std::to_string( index ) );
+        }
+        else if ( valname == "$$(memo_type)" )
+        {
+            r.replace( _nterm_lookup.at( nterm )->ntype );
+        }
+        else if ( valname == "$$(memo_index)" )
+        {
+            int index = nterm->value - _action_table->token_count;
+            r.replace( std::to_string( index ) );
+        }
+        else if ( valname == "$$(entry_type)" )
+        {
+            r.replace( _nterm_lookup.at( nterm )->ntype );
+        }
+        else if ( valname == "$$(entry_name)" )
+        {
+            std::string name = "accept_";
+            name += syntax->source->text( nterm->name );
+            r.replace( name );
+        }
+        else if ( valname == "$$(entry_nterm)" )
+        {
+            r.replace( std::to_string( nterm->value ) );
+        }
+        else if ( valname == "$$(entry_state)" )
+        {
+            // Start states follow the root production's start state.
+            const std::vector< nonterminal* >& entries = syntax->entries;
+            size_t index = std::find( entries.begin(), entries.end(), nterm ) - entries.begin();
+            r.replace( std::to_string( _automata->starts.at( 1 + index )->index ) );
+        }
+        else if ( valname == "$$(entry_body)" )
+        {
+            std::string body;
+            body += nterm->saccept;
+            body += "\n";
+            r.replace( body );
+        }
+        else if ( valname == "$$(lazy_body)" )
+        {
+            std::string body;
+            body += nterm->lplace;
+            body += "\n";
+            r.replace( body );
+        }
+        else
+        {
+            assert( ! "invalid template" );
+        }
+    }
+
+    return line;
+}
+
+std::string write::replace( std::string line, int predicate )
+{
+    /*
+        $$(pred_name)
+        $$(pred_index)
+        $$(pred_body)
+    */
+
+    syntax_ptr syntax = _automata->syntax;
+    replacer r( line, "$$(" );
+    std::string_view valname;
+    while ( r.next( valname ) )
+    {
+        if ( valname == "$$(pred_name)" )
+        {
+            r.replace( std::string( "predicate_" ) + std::to_string( predicate ) );
+        }
+        else if ( valname == "$$(pred_index)" )
+        {
+            r.replace( std::to_string( predicate ) );
+        }
+        else if ( valname == "$$(pred_body)" )
+        {
+            std::string body;
+            body += syntax->predicates.at( predicate );
+            body += "\n";
+            r.replace( body );
+        }
         else
         {
             assert( ! "invalid template" );
@@ -733,7 +1193,6 @@ std::string write::replace( std::string line, rule* rule, bool header )
         $$(rule_param)
         $$(rule_body)
         $$(rule_index)
-        $$(rule_assign)
         $$(rule_args)
     */
 
@@ -819,17 +1278,6 @@ std::string write::replace( std::string line, rule* rule, bool header )
         {
             r.replace( std::to_string( rule->index ) );
         }
-        else if ( valname == "$$(rule_assign)" )
-        {
-            if ( rule->locount > 1 )
-            {
-                r.replace( "p[ 0 ] = value( p[ 0 ].state(), " );
-            }
-            else
-            {
-                r.replace( "values.emplace_back( s->state, " );
-            }
-        }
         else if ( valname == "$$(rule_args)" )
         {
             std::string args;
@@ -903,6 +1351,108 @@ std::string write::write_table( const std::vector< int >& table )
 }
 
 
+std::string write::write_lazy_table()
+{
+    int token_count = (int)_automata->syntax->terminals.size();
+    source_ptr source = _automata->syntax->source;
+    const std::vector< int >& table = _action_table->lazy_states;
+
+    // Map nonterminal indices back to nonterminals for comments.
+    std::unordered_map< int, nonterminal* > nterms;
+    for ( nonterminal* nterm : _nterms )
+    {
+        nterms.emplace( nterm->value - token_count, nterm );
+    }
+
+    std::string s;
+    for ( size_t i = 0; i < table.size(); i += 3 )
+    {
+        nonterminal* nterm = nterms.at( table.at( i + 1 ) );
+        s += "    { ";
+        s += std::to_string( table.at( i ) );
+        s += ", ";
+        s += std::to_string( table.at( i + 1 ) );
+        s += ", ";
+        s += std::to_string( table.at( i + 2 ) );
+        s += ", ";
+        s += nterm->memoize ? "true" : "false";
+        s += " }, // ";
+        s += source->text( nterm->name );
+        s += " : ";
+        s += source->text( nterm->lopen->name );
+        s += " ... ";
+        s += source->text( nterm->lclose->name );
+        s += "\n";
+    }
+
+    return s;
+}
+
+
+std::string write::write_lookahead_table()
+{
+    source_ptr source = _automata->syntax->source;
+    const std::vector< int >& table = _action_table->lookaheads;
+
+    std::string s;
+    for ( size_t i = 0; i < table.size(); i += 3 )
+    {
+        s += "    { ";
+        s += std::to_string( table.at( i ) );
+        s += ", ";
+        s += std::to_string( table.at( i + 1 ) );
+        s += ", ";
+        s += std::to_string( table.at( i + 2 ) );
+        s += " }, // ";
+        s += source->text( _tokens.at( table.at( i ) )->name );
+        s += " ";
+        s += source->text( _tokens.at( table.at( i + 1 ) )->name );
+        s += "\n";
+    }
+
+    return s;
+}
+
+
+std::string write::write_grammar_hash()
+{
+    // Hash the tables, symbols, value types, and actions, so that a parser
+    // can reject state serialized by a parser generated from another grammar.
+    source_ptr source = _automata->syntax->source;
+    std::string s;
+    s += write_table( _action_table->actions );
+    s += write_table( _action_table->conflicts );
+    s += write_table( _goto_table->gotos );
+    s += write_rule_table();
+    for ( terminal* token : _tokens )
+    {
+        s += source->text( token->name );
+        s += "\n";
+    }
+    for ( nonterminal* nterm : _nterms )
+    {
+        s += source->text( nterm->name );
+        s += " ";
+        s += _nterm_lookup.at( nterm )->ntype;
+        s += "\n";
+    }
+    for ( const auto& rule : _automata->syntax->rules )
+    {
+        s += rule->action;
+        s += "\n";
+    }
+
+    uint64_t hash = UINT64_C( 14695981039346656037 );
+    for ( char c : s )
+    {
+        hash = ( hash ^ (unsigned char)c ) * UINT64_C( 1099511628211 );
+    }
+
+    // Written as two ints, as serialized values are ints.
+    return std::to_string( (int32_t)(uint32_t)hash ) + ", " + std::to_string( (int32_t)(uint32_t)( hash >> 32 ) );
+}
+
+
 std::string write::write_rule_table()
 {
     int token_count = (int)_automata->syntax->terminals.size();
@@ -918,6 +1468,12 @@ std::string write::write_rule_table()
         s += std::to_string( (int)rule->locount - 1 );
         s += ", ";
         s += rule->nterm->gspecified ? "1" : "0";
+        s += ", ";
+        s += rule->nterm->stops ? "1" : "0";
+        s += ", ";
+        s += rule->nterm->yields ? "1" : "0";
+        s += ", ";
+        s += std::to_string( rule->dprec );
         s += " }, // ";
 
         s += source->text( rule->nterm->name );
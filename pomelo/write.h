@@ -15,6 +15,7 @@
 
 
 #include "actions.h"
+#include "scanner.h"
 
 
 class write;
@@ -30,6 +31,7 @@ public:
         automata_ptr automata,
         action_table_ptr action_table,
         goto_table_ptr goto_table,
+        scanner_table_ptr scanner_table,
         const std::string& source,
         const std::string& output
     );
@@ -51,19 +53,25 @@ private:
     std::string trim( const std::string& s );
     bool starts_with( const std::string& s, const std::string& z );
         
+    bool condition( const std::string& flag );
     bool write_template( FILE* f, char* source, size_t length, bool header );
     std::string replace( std::string line );
     std::string replace( std::string line, terminal* token );
     std::string replace( std::string line, nonterminal* nterm );
+    std::string replace( std::string line, int predicate );
     std::string replace( std::string line, ntype* ntype );
     std::string replace( std::string line, rule* rule, bool header );
     std::string write_table( const std::vector< int >& table );
     std::string write_rule_table();
+    std::string write_grammar_hash();
+    std::string write_lazy_table();
+    std::string write_lookahead_table();
 
     errors_ptr _errors;
     automata_ptr _automata;
     action_table_ptr _action_table;
     goto_table_ptr _goto_table;
+    scanner_table_ptr _scanner_table;
     std::string _source;
     std::string _output_h;
     std::vector< terminal* > _tokens;